@@ -0,0 +1,89 @@
+// Header
+#include "async_writer.hpp"
+
+// stdlib
+#include <filesystem>
+#include <stdio.h>
+
+Async_Writer::Async_Writer() :
+	m_writing(false),
+	m_failed(false),
+	m_stop(false)
+{
+	m_thread = std::thread(&Async_Writer::run, this);
+}
+
+Async_Writer::~Async_Writer()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wake.notify_one();
+	m_thread.join();
+}
+
+void Async_Writer::write(const std::string& path, std::vector<char> bytes)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		bool replaced = false;
+		for (Pending& pending : m_pending) {
+			if (pending.path == path) {
+				pending.bytes.swap(bytes);
+				replaced = true;
+			}
+		}
+		if (!replaced) {
+			m_pending.push_back({ path, std::move(bytes) });
+		}
+	}
+	m_wake.notify_one();
+}
+
+bool Async_Writer::flush()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_idle.wait(lock, [this] { return m_pending.empty() && !m_writing; });
+	bool ok = !m_failed;
+	m_failed = false;
+	return ok;
+}
+
+void Async_Writer::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;) {
+		m_wake.wait(lock, [this] { return m_stop || !m_pending.empty(); });
+		if (m_pending.empty())
+			return;
+
+		Pending pending = std::move(m_pending.front());
+		m_pending.erase(m_pending.begin());
+		m_writing = true;
+		lock.unlock();
+
+		std::string temporary = pending.path + ".tmp";
+		bool ok = false;
+		FILE* file = fopen(temporary.c_str(), "wb");
+		if (file != nullptr) {
+			ok = fwrite(pending.bytes.data(), 1, pending.bytes.size(), file) == pending.bytes.size();
+			ok = fclose(file) == 0 && ok;
+		}
+		std::error_code error;
+		if (ok) {
+			std::filesystem::rename(temporary, pending.path, error);
+			ok = !error;
+		}
+		if (!ok) {
+			fprintf(stderr, "Failed to write %s\n", pending.path.c_str());
+		}
+
+		lock.lock();
+		m_failed = m_failed || !ok;
+		m_writing = false;
+		if (m_pending.empty()) {
+			m_idle.notify_all();
+		}
+	}
+}
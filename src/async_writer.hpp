@@ -0,0 +1,45 @@
+#pragma once
+
+// stdlib
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Writes whole files on a background thread. A file is written next to its path and renamed
+// over it once complete, so readers see either the previous version or the new one. Only the
+// newest pending bytes of a path are kept, a slow disk drops intermediate versions instead of
+// stalling the caller.
+class Async_Writer
+{
+public:
+	Async_Writer();
+	~Async_Writer(); // waits for the pending writes
+
+	void write(const std::string& path, std::vector<char> bytes);
+
+	// Blocks until every pending write is done, false if any write failed since the last call
+	bool flush();
+
+private:
+	Async_Writer(const Async_Writer&);
+	Async_Writer& operator=(const Async_Writer&);
+
+	struct Pending
+	{
+		std::string path;
+		std::vector<char> bytes;
+	};
+
+	void run();
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_idle;
+	std::vector<Pending> m_pending;
+	bool m_writing;
+	bool m_failed;
+	bool m_stop;
+};
@@ -0,0 +1,206 @@
+// Header
+#include "batch_eval.hpp"
+
+// stdlib
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <random>
+#include <thread>
+#include <stdio.h>
+
+namespace
+{
+	const char* ENEMY_NAMES[4] = { "bat", "skeleton", "knight", "pathfinder" };
+
+	struct Config
+	{
+		std::string level;
+		int enemy_type;
+		std::vector<std::unique_ptr<Grid_World>> worlds; // one per thread
+		DQN_Model model;
+		std::vector<Policy> heroes; // one per thread, a model backed policy fills itself as it plays
+		std::vector<std::pair<ivec2, ivec2>> starts;
+		std::vector<int> scores; // episodes per start pair
+		int64_t first_job;
+	};
+
+	int percentile(const std::vector<int>& sorted, double q)
+	{
+		size_t rank = (size_t)(q * (sorted.size() - 1) + 0.5);
+		return sorted[rank];
+	}
+}
+
+bool Batch_Eval::run(const std::vector<std::string>& levels, const std::vector<int>& enemy_types, const std::string& algo,
+	int episodes, int samples, int steps, int n_threads, const std::string& csv_path)
+{
+	n_threads = std::max(1, n_threads);
+	episodes = std::max(1, episodes);
+	m_results.clear();
+
+	// Worlds are set up here, init() is not thread safe
+	std::vector<std::unique_ptr<Config>> configs;
+	int64_t n_jobs = 0;
+	for (const std::string& level : levels) {
+		for (int enemy_type : enemy_types) {
+			std::unique_ptr<Config> config(new Config());
+			config->level = level;
+			config->enemy_type = enemy_type;
+			for (int t = 0; t < n_threads; ++t) {
+				std::unique_ptr<Grid_World> world(new Grid_World());
+				if (!world->init(level, algo, enemy_type, { 0, 0 }, { 0, 0 })) {
+					fprintf(stderr, "Failed to set up %s %s\n", level.c_str(), ENEMY_NAMES[enemy_type]);
+					// The half set up world and those of the earlier configs as well
+					world->destroy();
+					configs.push_back(std::move(config));
+					for (auto& set_up : configs) {
+						for (auto& w : set_up->worlds) {
+							w->destroy();
+						}
+					}
+					return false;
+				}
+				config->worlds.push_back(std::move(world));
+			}
+
+			Grid_World& world = *config->worlds[0];
+			std::string filename_policy = std::string(ENEMY_NAMES[enemy_type]) + "-" + world.m_level_name + "-" + algo + "_policy.txt";
+			config->heroes.resize(n_threads);
+			if (algo == "dqn" && config->model.load(DQN_Model::directory(enemy_type, world.m_level_name) + "model.pt")) {
+				for (Policy& hero : config->heroes) {
+					config->model.attach(hero, world);
+				}
+			}
+			else {
+				config->heroes[0].init(&world.m_state_index);
+				if (!config->heroes[0].load_txt(policies_path(filename_policy))) {
+					fprintf(stderr, "Skipping %s %s, no policy\n", level.c_str(), ENEMY_NAMES[enemy_type]);
+					for (auto& w : config->worlds) {
+						w->destroy();
+					}
+					continue;
+				}
+				std::fill(config->heroes.begin() + 1, config->heroes.end(), config->heroes[0]);
+			}
+
+			const Level& lvl = world.m_level;
+			for (int h = 0; h < lvl.m_n_free; ++h) {
+				for (int e = 0; e < lvl.m_n_free; ++e) {
+					if (h == e)
+						continue;
+					int hero = lvl.m_free_cells[h];
+					int enemy = lvl.m_free_cells[e];
+					config->starts.push_back({ { hero / lvl.m_cols, hero % lvl.m_cols }, { enemy / lvl.m_cols, enemy % lvl.m_cols } });
+				}
+			}
+			if (samples > 0 && (size_t)samples < config->starts.size()) {
+				std::mt19937 rng(1234);
+				std::shuffle(config->starts.begin(), config->starts.end(), rng);
+				config->starts.resize(samples);
+			}
+
+			config->scores.assign(config->starts.size() * episodes, 0);
+			config->first_job = n_jobs;
+			n_jobs += (int64_t)config->starts.size();
+			configs.push_back(std::move(config));
+		}
+	}
+
+	std::atomic<int64_t> next_job(0);
+	auto work = [&](int thread) {
+		size_t c = 0;
+		for (int64_t job = next_job++; job < n_jobs; job = next_job++) {
+			while (c + 1 < configs.size() && configs[c + 1]->first_job <= job) {
+				++c;
+			}
+			Config& config = *configs[c];
+			int64_t pair = job - config.first_job;
+			Grid_World& world = *config.worlds[thread];
+			const Policy& hero = config.heroes[thread];
+
+			world.set_start_cells(config.starts[pair].first, config.starts[pair].second);
+			world.seed((unsigned)(job * 2654435761u));
+			for (int episode = 0; episode < episodes; ++episode) {
+				world.reset();
+				for (int t = 0; t < steps; ++t) {
+					std::vector<int64_t> s = world.extract_state();
+					world.update(hero.action((int)s[0], (int)s[1], (int)s[2], (int)s[3], (int)s[4]));
+				}
+				config.scores[pair * episodes + episode] = world.m_points;
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int t = 1; t < n_threads; ++t) {
+		threads.emplace_back(work, t);
+	}
+	work(0);
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	FILE* csv = nullptr;
+	if (!csv_path.empty()) {
+		csv = fopen(csv_path.c_str(), "wb");
+		if (csv == nullptr) {
+			fprintf(stderr, "Failed to open %s for writing\n", csv_path.c_str());
+		}
+		else {
+			fprintf(csv, "level,enemy,hero_row,hero_col,enemy_row,enemy_col,mean,min,max\n");
+		}
+	}
+
+	for (const std::unique_ptr<Config>& config : configs) {
+		if (csv != nullptr) {
+			for (size_t pair = 0; pair < config->starts.size(); ++pair) {
+				const int* scores = &config->scores[pair * episodes];
+				double mean = 0.0;
+				for (int e = 0; e < episodes; ++e) {
+					mean += scores[e];
+				}
+				fprintf(csv, "%s,%s,%d,%d,%d,%d,%.3f,%d,%d\n", config->level.c_str(), ENEMY_NAMES[config->enemy_type],
+					config->starts[pair].first.x, config->starts[pair].first.y, config->starts[pair].second.x, config->starts[pair].second.y,
+					mean / episodes, *std::min_element(scores, scores + episodes), *std::max_element(scores, scores + episodes));
+			}
+		}
+
+		std::vector<int> sorted = config->scores;
+		std::sort(sorted.begin(), sorted.end());
+		Result result;
+		result.level = config->level;
+		result.enemy_type = config->enemy_type;
+		result.n_starts = (int)config->starts.size();
+		result.n_episodes = (int)sorted.size();
+		result.mean = 0.0;
+		for (int score : sorted) {
+			result.mean += score;
+		}
+		result.mean /= std::max<size_t>(1, sorted.size());
+		result.min = sorted.empty() ? 0 : sorted.front();
+		result.p10 = sorted.empty() ? 0 : percentile(sorted, 0.1);
+		result.p50 = sorted.empty() ? 0 : percentile(sorted, 0.5);
+		result.p90 = sorted.empty() ? 0 : percentile(sorted, 0.9);
+		result.max = sorted.empty() ? 0 : sorted.back();
+		m_results.push_back(result);
+
+		for (auto& world : config->worlds) {
+			world->destroy();
+		}
+	}
+
+	if (csv != nullptr) {
+		fclose(csv);
+	}
+	return true;
+}
+
+void Batch_Eval::print() const
+{
+	printf("%-14s %-9s %7s %9s %10s %8s %8s %8s %8s %8s\n", "level", "enemy", "starts", "episodes", "mean", "min", "p10", "p50", "p90", "max");
+	for (const Result& result : m_results) {
+		printf("%-14s %-9s %7d %9d %10.1f %8d %8d %8d %8d %8d\n", result.level.c_str(), ENEMY_NAMES[result.enemy_type],
+			result.n_starts, result.n_episodes, result.mean, result.min, result.p10, result.p50, result.p90, result.max);
+	}
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "grid_world.hpp"
+
+// stdlib
+#include <string>
+#include <vector>
+
+// Greedy rollouts of the trained hero policies over many start cells, levels and enemies. Every
+// configuration gets one headless world per thread, start pairs are handed out to a pool of
+// threads and each pair seeds its world from its own position so the scores do not depend on
+// the scheduling.
+class Batch_Eval
+{
+public:
+	struct Result
+	{
+		std::string level;
+		int enemy_type;
+		int n_starts;
+		int n_episodes;
+		double mean;
+		int min;
+		int p10;
+		int p50;
+		int p90;
+		int max;
+	};
+
+	// Plays episodes episodes of steps steps from samples (hero cell, enemy cell) pairs, all pairs
+	// when samples is 0, for each level and enemy type. dqn heroes play their model.pt when there
+	// is one. Configurations without a policy are skipped, the per start pair means go to
+	// csv_path when it is not empty.
+	bool run(const std::vector<std::string>& levels, const std::vector<int>& enemy_types, const std::string& algo,
+		int episodes, int samples, int steps, int n_threads, const std::string& csv_path);
+
+	// Results as a levels x enemies matrix on stdout
+	void print() const;
+
+	std::vector<Result> m_results;
+};
@@ -0,0 +1,414 @@
+// Benchmarks of the environment, the learners, Q-table formats, policy I/O and headless rendering.
+// Every benchmark is seeded the same way so runs on the same machine can be diffed:
+// ./bench [results.json] [--filter name]
+
+// internal
+#include "common.hpp"
+#include "grid_world.hpp"
+#include "soft_renderer.hpp"
+#include "policy.hpp"
+#include "deepQ.hpp"
+#include "tabq.hpp"
+
+#define GL3W_IMPLEMENTATION
+#include <gl3w.h>
+
+// stdlib
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// libtorch
+#include <torch/torch.h>
+
+namespace
+{
+	const unsigned SEED = 1234;
+	const double MIN_SECONDS = 0.5;
+
+	// Same as deepQ.cpp
+	const int BATCH_SIZE = 64;
+
+	const char* LEVELS[] = { "level_0.txt", "level_1.txt", "level_2.txt" };
+	const char* ENEMIES[] = { "bat", "skeleton", "knight", "pathfinder" };
+
+	// Q-table layouts of the tabq benchmarks, the reference float32 one first
+	struct Table_Layout
+	{
+		const char* name;
+		Q_Store::Format format;
+		Q_Table::Backend backend;
+		double symmetry_tolerance; // TabQ's, symmetries only fold tables under a tolerance on the shipped rules
+	};
+	const Table_Layout TABLES[] = {
+		{ "float32", Q_Store::FLOAT32, Q_Table::DENSE, 0.0 },
+		{ "fp16", Q_Store::FP16, Q_Table::DENSE, 0.0 },
+		{ "int8", Q_Store::INT8, Q_Table::DENSE, 0.0 },
+		{ "sparse", Q_Store::FLOAT32, Q_Table::SPARSE, 0.0 },
+		{ "folded", Q_Store::FLOAT32, Q_Table::DENSE, 0.05 }
+	};
+
+	struct Result
+	{
+		std::string name;
+		std::string unit;
+		int64_t iterations;
+		double seconds;
+	};
+
+	struct Table_Result
+	{
+		std::string name;
+		size_t bytes;
+		double agreement; // with the float32 greedy policy
+		double score;
+	};
+
+	std::vector<Result> g_results;
+	std::vector<Table_Result> g_tables;
+	std::string g_filter;
+
+	// Worlds have static storage so their headless-only members start zeroed like g_world in main.cpp
+	Grid_World g_worlds[N_ENEMY_TYPES][3];
+
+	void seed()
+	{
+		srand(SEED);
+		torch::manual_seed(SEED);
+	}
+
+	// Calls fn(n) with a growing n until one call takes MIN_SECONDS, fn performs n operations of unit
+	template <typename Fn>
+	void run(const std::string& name, const char* unit, Fn fn)
+	{
+		if (!g_filter.empty() && name.find(g_filter) == std::string::npos)
+			return;
+
+		seed();
+		int64_t n = 1;
+		double seconds = 0.0;
+		for (;;) {
+			auto start = std::chrono::steady_clock::now();
+			fn(n);
+			seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (seconds >= MIN_SECONDS)
+				break;
+			int64_t next = seconds > 0.0 ? (int64_t)(n * 1.2 * MIN_SECONDS / seconds) : n * 10;
+			n = std::max(n + 1, std::min(next, n * 10));
+		}
+
+		g_results.push_back({ name, unit, n, seconds });
+		fprintf(stderr, "%-40s %12.0f %s/s %12.1f ns\n", name.c_str(), n / seconds, unit, seconds * 1e9 / n);
+	}
+
+	bool exists(const std::string& path)
+	{
+		return std::ifstream(path).good();
+	}
+
+	std::string policy_file(int enemy_type, const std::string& level_name, const char* algo)
+	{
+		return std::string(ENEMIES[enemy_type]) + "-" + level_name + "-" + algo + "_policy.txt";
+	}
+
+	// Skeletons follow the bat policy and knights the skeleton one, only levels that have it are
+	// benchmarked. The pathfinder needs no policy.
+	Grid_World* world(int enemy_type, int level)
+	{
+		Grid_World& world = g_worlds[enemy_type][level];
+		if (world.m_rows > 0)
+			return &world;
+
+		std::string filename = LEVELS[level];
+		std::string level_name = filename.substr(0, filename.size() - 4);
+		if ((enemy_type == 1 || enemy_type == 2) && !exists(policies_path(policy_file(enemy_type - 1, level_name, "tabq"))))
+			return nullptr;
+
+		// First and last free cells, argv order is { col, row }
+		Level layout;
+		if (!layout.load(levels_path(filename)))
+			return nullptr;
+		int first = layout.m_free_cells[0];
+		int last = layout.m_free_cells[layout.m_n_free - 1];
+		std::vector<int> hero_pos = { first % layout.m_cols, first / layout.m_cols };
+		std::vector<int> enemy_pos = { last % layout.m_cols, last / layout.m_cols };
+
+		if (!world.init(filename, "tabq", enemy_type, hero_pos, enemy_pos))
+			return nullptr;
+		world.seed(SEED);
+		return &world;
+	}
+
+	void bench_env()
+	{
+		for (int enemy_type = 0; enemy_type < N_ENEMY_TYPES; ++enemy_type) {
+			for (int level = 0; level < 3; ++level) {
+				Grid_World* w = world(enemy_type, level);
+				if (w == nullptr)
+					continue;
+				run(std::string("env_step/") + ENEMIES[enemy_type] + "/" + w->m_level_name, "steps", [w](int64_t n) {
+					std::mt19937 rng(SEED);
+					w->seed(SEED);
+					w->reset();
+					for (int64_t i = 0; i < n; ++i) {
+						// Episodes as long as TabQ's
+						if (i % 500 == 0)
+							w->reset();
+						w->update((int64_t)(rng() % 13));
+					}
+				});
+			}
+		}
+	}
+
+	void bench_tabq()
+	{
+		for (int level = 0; level < 3; ++level) {
+			Grid_World* w = world(0, level);
+			if (w == nullptr)
+				continue;
+			for (const Table_Layout& layout : TABLES) {
+				std::string name = std::string("tabq_update/") + w->m_level_name;
+				if (&layout != TABLES) {
+					name += std::string("/") + layout.name;
+				}
+				if (!g_filter.empty() && name.find(g_filter) == std::string::npos)
+					continue;
+
+				TabQ tabq(w, false, layout.format, layout.backend, layout.symmetry_tolerance);
+				tabq.seed(SEED);
+				tabq.init_table();
+				fprintf(stderr, "%-40s %12zu bytes\n", name.c_str(), tabq.table_bytes());
+				run(name, "updates", [&tabq](int64_t n) {
+					for (int64_t i = 0; i < n; i += tabq.MAX_TIME) {
+						tabq.episode();
+					}
+				});
+			}
+		}
+	}
+
+	// Same training run in every table layout, then the greedy policies against the float32 one:
+	// share of the states where they pick the same action and mean greedy score
+	void bench_tabq_quality()
+	{
+		const int EPISODES = 2000;
+		const int EVAL_EPISODES = 50;
+		Grid_World* w = world(0, 2);
+		if (w == nullptr)
+			return;
+		std::string prefix = std::string("tabq_quality/") + w->m_level_name;
+		if (!g_filter.empty() && prefix.find(g_filter) == std::string::npos)
+			return;
+
+		const State_Index& index = w->m_state_index;
+		std::vector<uint8_t> reference;
+		for (const Table_Layout& layout : TABLES) {
+			TabQ tabq(w, false, layout.format, layout.backend, layout.symmetry_tolerance);
+			tabq.seed(SEED);
+			tabq.init_table();
+			w->seed(SEED);
+			for (int e = 0; e < EPISODES; ++e) {
+				tabq.episode();
+			}
+
+			std::vector<uint8_t> actions(index.size(), 0);
+			std::vector<int64_t> state(5);
+			for (int64_t idx = 0; idx < index.size(); ++idx) {
+				if (index.is_exported(idx)) {
+					index.state(idx, state.data());
+					actions[idx] = (uint8_t)tabq.greedy(state);
+				}
+			}
+			if (reference.empty()) {
+				reference = actions;
+			}
+			int64_t same = 0;
+			int64_t exported = 0;
+			for (int64_t idx = 0; idx < index.size(); ++idx) {
+				if (index.is_exported(idx)) {
+					same += actions[idx] == reference[idx];
+					exported++;
+				}
+			}
+
+			w->seed(SEED);
+			double score = 0.0;
+			for (int e = 0; e < EVAL_EPISODES; ++e) {
+				w->reset();
+				for (int t = 0; t < tabq.MAX_TIME; ++t) {
+					w->update(tabq.greedy(w->extract_state()));
+				}
+				score += w->m_points;
+			}
+
+			Table_Result result = { prefix + "/" + layout.name, tabq.table_bytes(), (double)same / exported, score / EVAL_EPISODES };
+			g_tables.push_back(result);
+			fprintf(stderr, "%-40s %12zu bytes %8.4f agreement %10.1f score\n", result.name.c_str(), result.bytes, result.agreement, result.score);
+		}
+	}
+
+	void bench_dqn()
+	{
+		Grid_World* w = world(0, 2);
+		if (w == nullptr)
+			return;
+
+		// Replay buffer filled with random walks of the environment
+		deepQ::ReplayBuffer buffer;
+		std::mt19937 rng(SEED);
+		w->reset();
+		for (int i = 0; i < buffer.size; ++i) {
+			std::vector<int64_t> state = w->extract_state();
+			int64_t action = rng() % 9;
+			w->update(action);
+			buffer.add_experience(state, w->extract_state(), action, (int)(rng() % 200) - 100);
+		}
+
+		run("dqn_replay_batch", "batches", [&buffer, &rng](int64_t n) {
+			for (int64_t i = 0; i < n; ++i) {
+				std::vector<int> batch = buffer.sample_experiences(BATCH_SIZE, rng);
+				torch::Tensor states_prev, states_next, actions, rewards;
+				deepQ::make_batch(buffer, batch, states_prev, states_next, actions, rewards);
+			}
+		});
+
+		deepQ::Net net(5, 9);
+		torch::NoGradGuard no_grad;
+		torch::Tensor state = torch::rand({ 5 }) * 10;
+		torch::Tensor states = torch::rand({ BATCH_SIZE, 5 }) * 10;
+		run("dqn_forward/1", "forwards", [&](int64_t n) {
+			for (int64_t i = 0; i < n; ++i) {
+				net.select_action(state);
+			}
+		});
+		run("dqn_forward/64", "forwards", [&](int64_t n) {
+			for (int64_t i = 0; i < n; ++i) {
+				net.forward(states);
+			}
+		});
+	}
+
+	void bench_policy()
+	{
+		Grid_World* w = world(0, 2);
+		if (w == nullptr)
+			return;
+
+		const char* algos[] = { "tabq", "dqn" };
+		for (const char* algo : algos) {
+			std::string filename = policy_file(0, w->m_level_name, algo);
+			std::string path = policies_path(filename);
+			if (!exists(path))
+				continue;
+
+			Policy policy;
+			policy.init(&w->m_state_index);
+			run("policy_load/" + filename, "loads", [&](int64_t n) {
+				for (int64_t i = 0; i < n; ++i) {
+					policy.load_txt(path);
+				}
+			});
+			run("policy_save/" + filename, "saves", [&](int64_t n) {
+				for (int64_t i = 0; i < n; ++i) {
+					policy.save_txt("bench_policy.txt");
+				}
+			});
+		}
+		remove("bench_policy.txt");
+	}
+
+	void bench_render()
+	{
+		struct Config { Soft_Renderer::Format format; int downscale; const char* name; };
+		const Config configs[] = { { Soft_Renderer::RGB, 1, "rgb" }, { Soft_Renderer::GRAY, 4, "gray_4" } };
+		for (const Config& config : configs) {
+			Soft_Renderer renderer;
+			if (!renderer.init(config.format, config.downscale))
+				return;
+			for (int level = 0; level < 3; ++level) {
+				Grid_World* w = world(0, level);
+				if (w == nullptr)
+					continue;
+				std::vector<uint8_t> frame(renderer.frame_size(*w));
+				run(std::string("render/") + config.name + "/" + w->m_level_name, "frames", [&](int64_t n) {
+					for (int64_t i = 0; i < n; ++i) {
+						renderer.render(*w, frame.data());
+					}
+				});
+			}
+		}
+	}
+
+	void write_json(std::ostream& out)
+	{
+		out << "{\n";
+		out << "  \"seed\": " << SEED << ",\n";
+		out << "  \"min_seconds\": " << MIN_SECONDS << ",\n";
+		out << "  \"benchmarks\": [\n";
+		for (size_t i = 0; i < g_results.size(); ++i) {
+			const Result& r = g_results[i];
+			out << "    { \"name\": \"" << r.name << "\", \"unit\": \"" << r.unit
+				<< "\", \"iterations\": " << r.iterations
+				<< ", \"seconds\": " << r.seconds
+				<< ", \"per_second\": " << r.iterations / r.seconds
+				<< ", \"ns_per_op\": " << r.seconds * 1e9 / r.iterations << " }"
+				<< (i + 1 < g_results.size() ? ",\n" : "\n");
+		}
+		out << "  ],\n";
+		out << "  \"tables\": [\n";
+		for (size_t i = 0; i < g_tables.size(); ++i) {
+			const Table_Result& r = g_tables[i];
+			out << "    { \"name\": \"" << r.name << "\", \"bytes\": " << r.bytes
+				<< ", \"agreement\": " << r.agreement
+				<< ", \"score\": " << r.score << " }"
+				<< (i + 1 < g_tables.size() ? ",\n" : "\n");
+		}
+		out << "  ]\n";
+		out << "}\n";
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	std::string output;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--filter" && i + 1 < argc) {
+			g_filter = argv[++i];
+		}
+		else if (output.empty() && arg.compare(0, 2, "--") != 0) {
+			output = arg;
+		}
+		else {
+			std::cout << "[ ERROR ] incorrect args\n";
+			std::cout << "[ EXAMPLE ./bench results.json --filter env_step \n";
+			return EXIT_FAILURE;
+		}
+	}
+
+	torch::set_num_threads(1);
+
+	bench_env();
+	bench_tabq();
+	bench_tabq_quality();
+	bench_dqn();
+	bench_policy();
+	bench_render();
+
+	if (output.empty()) {
+		write_json(std::cout);
+	}
+	else {
+		std::ofstream file(output, std::ios_base::trunc);
+		if (!file) {
+			std::cout << "[ ERROR ] cannot write " << output << "\n";
+			return EXIT_FAILURE;
+		}
+		write_json(file);
+	}
+	return EXIT_SUCCESS;
+}
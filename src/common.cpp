@@ -53,7 +53,7 @@ vec2 add(vec2 a, vec2 b) { return { a.x + b.x, a.y + b.y }; }
 vec2 sub(vec2 a, vec2 b) { return { a.x - b.x, a.y - b.y }; }
 bool operator==(const vec2& a, const vec2& b) { return a.x == b.x && a.y == b.y; }
 
-Texture::Texture()
+Texture::Texture() : id(0), width(0), height(0)
 {
 
 }
@@ -20,10 +20,12 @@
 #define levels_path(name) 		data_path "/levels/" + name
 #define textures_path(name)  	data_path "/textures/" name
 #define audio_path(name) 		data_path  "/audio/" name
+#define generated_path			PROJECT_SOURCE_DIR "./src/generated/"
 
 // Not much math is needed and there are already way too many libraries linked (:
 // If you want to do some overloads..
 struct vec2 { float x, y; };
+struct ivec2 { int x, y; };
 struct vec3 { float x, y, z; };
 struct mat3 { vec3 c0, c1, c2; };
 
@@ -32,6 +34,11 @@ vec2 add(vec2 a, vec2 b);
 vec2 sub(vec2 a, vec2 b);
 bool operator==(const vec2& a, const vec2& b);
 
+// Grid cells and directions, x is the row and y the column as in vec2 grid positions
+inline ivec2 add(ivec2 a, ivec2 b) { return { a.x + b.x, a.y + b.y }; }
+inline ivec2 sub(ivec2 a, ivec2 b) { return { a.x - b.x, a.y - b.y }; }
+inline bool operator==(const ivec2& a, const ivec2& b) { return a.x == b.x && a.y == b.y; }
+
 // OpenGL utilities
 // cleans error buffer
 void gl_flush_errors();
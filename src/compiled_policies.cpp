@@ -0,0 +1,22 @@
+// Header
+#include "policy.hpp"
+
+// distill writes one header per table to src/generated and regenerates generated/policies.hpp,
+// which defines COMPILED_POLICIES over all of them. Without it no table is compiled in.
+#if __has_include("generated/policies.hpp")
+#include "generated/policies.hpp"
+#define HAS_COMPILED_POLICIES
+#endif
+
+const Compiled_Policy* Policy::compiled(const std::string& name)
+{
+#ifdef HAS_COMPILED_POLICIES
+	for (const Compiled_Policy& table : COMPILED_POLICIES) {
+		if (name == table.name)
+			return &table;
+	}
+#else
+	(void)name;
+#endif
+	return nullptr;
+}
@@ -1,5 +1,16 @@
 #include "deepQ.hpp"
+#include "policy.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+#include "mapped_file.hpp"
+#include "reachable_states.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <sstream>
+#include <thread>
 #include <vector>
+#include <string.h>
 // #include "Windows.h"
 #include <iostream>
 #include <fstream>
@@ -11,11 +22,25 @@ const int BATCH_SIZE = 64;
 const float GAMMA = 0.99;
 
 
-deepQ::deepQ(Grid_World* grid_world) {
+deepQ::deepQ(Grid_World* grid_world, std::string model_path, bool reachable, std::string metric_prefix) {
 	m_world = grid_world;
+	MODEL_PATH = model_path;
+	m_reachable = reachable;
+	m_metric_prefix = metric_prefix;
 	m_action_dim = 9;
 	m_Net = std::make_shared<Net>(5, m_action_dim);
 	m_Target = std::make_shared<Net>(5, m_action_dim);
+	m_rng.seed((unsigned)time(NULL));
+}
+
+// Moves between hero and enemy along free cells, Chebyshev distance on levels without a distance
+// field and when they are not connected
+int hero_enemy_distance(const Distance_Field* distances, const std::vector<int64_t>& s) {
+	int chebyshev = (int)std::max(std::abs(s.at(0) - s.at(2)), std::abs(s.at(1) - s.at(3)));
+	if (distances == nullptr)
+		return chebyshev;
+	int path = distances->distance((int)s.at(0), (int)s.at(1), (int)s.at(2), (int)s.at(3));
+	return path == Distance_Field::UNREACHABLE ? chebyshev : path;
 }
 
 torch::Tensor convert_vector_to_tensor(std::vector<int64_t> s) {
@@ -27,6 +52,142 @@ torch::Tensor convert_vector_to_tensor(std::vector<int64_t> s) {
 	return x;
 }
 
+void deepQ::make_batch(const ReplayBuffer& buffer, const std::vector<int>& batch, torch::Tensor& states_prev, torch::Tensor& states_next, torch::Tensor& actions, torch::Tensor& rewards) {
+	int64_t batch_size = batch.size();
+	states_prev = torch::zeros({ batch_size, ReplayBuffer::STATE_SIZE });
+	states_next = torch::zeros({ batch_size, ReplayBuffer::STATE_SIZE });
+	actions = torch::zeros({ batch_size });
+	rewards = torch::zeros({ batch_size });
+
+	auto access_states_prev = states_prev.accessor<float, 2>();
+	auto access_states_next = states_next.accessor<float, 2>();
+	auto access_actions = actions.accessor<float, 1>();
+	auto access_rewards = rewards.accessor<float, 1>();
+
+	for (int sample = 0; sample < batch_size; ++sample) {
+		size_t slot = batch[sample];
+		for (int elem = 0; elem < ReplayBuffer::STATE_SIZE; ++elem) {
+			access_states_prev[sample][elem] = buffer.states_prev[slot * ReplayBuffer::STATE_SIZE + elem];
+			access_states_next[sample][elem] = buffer.states_next[slot * ReplayBuffer::STATE_SIZE + elem];
+		}
+		access_actions[sample] = buffer.actions[slot];
+		access_rewards[sample] = buffer.rewards[slot];
+	}
+}
+
+torch::Tensor deepQ::invalid_offsets(const std::vector<int>& batch) const {
+	int64_t batch_size = batch.size();
+	torch::Tensor offsets = torch::zeros({ batch_size, (int64_t)m_action_dim });
+	auto access_offsets = offsets.accessor<float, 2>();
+	for (int sample = 0; sample < batch_size; ++sample) {
+		int64_t state[ReplayBuffer::STATE_SIZE];
+		for (int elem = 0; elem < ReplayBuffer::STATE_SIZE; ++elem) {
+			state[elem] = m_replay_buffer.states_next[(size_t)batch[sample] * ReplayBuffer::STATE_SIZE + elem];
+		}
+		uint32_t valid = valid_actions(state);
+		for (int action = 0; action < m_action_dim; ++action) {
+			if (!((valid >> action) & 1)) {
+				access_offsets[sample][action] = -1e9f;
+			}
+		}
+	}
+	return offsets;
+}
+
+void deepQ::checkpoint(torch::optim::Optimizer& optimizer, const DQN_Progress& progress) {
+	TRACE_ZONE_ALWAYS("checkpoint");
+	torch::serialize::OutputArchive archive, net, target, optimizer_archive;
+	m_Net->save(net);
+	m_Target->save(target);
+	optimizer.save(optimizer_archive);
+	archive.write("net", net);
+	archive.write("target", target);
+	archive.write("optimizer", optimizer_archive);
+	std::string archive_bytes;
+	archive.save_to([&archive_bytes](const void* data, size_t size) {
+		archive_bytes.append((const char*)data, size);
+		return size;
+	});
+
+	const ReplayBuffer& replay = m_replay_buffer;
+	size_t states_size = replay.states_prev.size() * sizeof(int32_t);
+	size_t size = (size_t)replay.size * sizeof(int32_t);
+
+	DQN_Checkpoint_Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "DQNC", 4);
+	header.version = 1;
+	header.level_hash = m_world->m_level.hash();
+	header.progress = progress;
+	header.replay_size = (uint32_t)replay.size;
+	header.replay_count = replay.n_exp;
+	header.archive_size = archive_bytes.size();
+	header.replay_offset = (CHECKPOINT_DATA + archive_bytes.size() + 7) & ~(size_t)7;
+
+	std::ostringstream trainer, world;
+	trainer << m_rng;
+	world << m_world->rng();
+	strncpy(header.rng[0], trainer.str().c_str(), sizeof(header.rng[0]) - 1);
+	strncpy(header.rng[1], world.str().c_str(), sizeof(header.rng[1]) - 1);
+
+	std::vector<char> bytes(header.replay_offset + 2 * states_size + 2 * size, 0);
+	char* out = bytes.data();
+	memcpy(out, &header, sizeof(header));
+	memcpy(out + CHECKPOINT_DATA, archive_bytes.data(), archive_bytes.size());
+	out += header.replay_offset;
+	memcpy(out, replay.states_prev.data(), states_size);
+	memcpy(out + states_size, replay.states_next.data(), states_size);
+	memcpy(out + 2 * states_size, replay.actions.data(), size);
+	memcpy(out + 2 * states_size + size, replay.rewards.data(), size);
+
+	m_writer.write(MODEL_PATH + "checkpoint.bin", std::move(bytes));
+}
+
+bool deepQ::load_checkpoint(const std::string& path, torch::optim::Optimizer& optimizer, DQN_Progress& progress) {
+	Mapped_File file;
+	if (!file.open(path.c_str())) {
+		fprintf(stderr, "Failed to map %s\n", path.c_str());
+		return false;
+	}
+
+	ReplayBuffer& replay = m_replay_buffer;
+	size_t states_size = replay.states_prev.size() * sizeof(int32_t);
+	size_t size = (size_t)replay.size * sizeof(int32_t);
+
+	const DQN_Checkpoint_Header* header = (const DQN_Checkpoint_Header*)file.data;
+	if (file.size < CHECKPOINT_DATA || memcmp(header->magic, "DQNC", 4) != 0 || header->version != 1 ||
+		header->level_hash != m_world->m_level.hash() || header->replay_size != (uint32_t)replay.size ||
+		header->replay_offset < CHECKPOINT_DATA + header->archive_size ||
+		file.size < header->replay_offset + 2 * states_size + 2 * size) {
+		fprintf(stderr, "%s is not a checkpoint of this level and learner\n", path.c_str());
+		return false;
+	}
+
+	torch::serialize::InputArchive archive, net, target, optimizer_archive;
+	archive.load_from((const char*)file.data + CHECKPOINT_DATA, header->archive_size);
+	archive.read("net", net);
+	archive.read("target", target);
+	archive.read("optimizer", optimizer_archive);
+	m_Net->load(net);
+	m_Target->load(target);
+	optimizer.load(optimizer_archive);
+
+	// The arrays are stored as the buffer holds them
+	const uint8_t* in = file.data + header->replay_offset;
+	memcpy(replay.states_prev.data(), in, states_size);
+	memcpy(replay.states_next.data(), in + states_size, states_size);
+	memcpy(replay.actions.data(), in + 2 * states_size, size);
+	memcpy(replay.rewards.data(), in + 2 * states_size + size, size);
+	replay.n_exp = header->replay_count;
+
+	std::istringstream trainer(std::string(header->rng[0], strnlen(header->rng[0], sizeof(header->rng[0]))));
+	std::istringstream world(std::string(header->rng[1], strnlen(header->rng[1], sizeof(header->rng[1]))));
+	trainer >> m_rng;
+	world >> m_world->rng();
+	progress = header->progress;
+	return true;
+}
+
 void deepQ::load(std::string path) {
 	torch::serialize::InputArchive input_archive;
 	input_archive.load_from(path);
@@ -35,54 +196,84 @@ void deepQ::load(std::string path) {
 }
 
 void deepQ::save_as_txt(std::string path) {
-	std::ofstream myfile;
-	myfile.open(path);
-	
-	for (int hero_row = 0; hero_row < m_world->m_rows; ++hero_row) {
-		for (int hero_col = 0; hero_col < m_world->m_cols; ++hero_col) {
-			for (int enemy_row = 0; enemy_row < m_world->m_rows; ++enemy_row) {
-				for (int enemy_col = 0; enemy_col < m_world->m_cols; ++enemy_col) {
-					for (int enemy_act = 0; enemy_act < m_action_dim; ++enemy_act) {
-						int action = m_Net->select_action(convert_vector_to_tensor(std::vector<int64_t>{hero_row, hero_col, enemy_row, enemy_col, enemy_act}));
-						myfile << std::to_string(hero_row) << ","
-							<< std::to_string(hero_col) << ","
-							<< std::to_string(enemy_row) << ","
-							<< std::to_string(enemy_col) << ","
-							<< std::to_string(enemy_act) << "="
-							<< std::to_string(action) << std::endl;
-					}
-				}
+	TRACE_ZONE_ALWAYS("policy_export");
+	// Only walkable cells are exported, in the same order as the full grid sweep
+	const State_Index& index = m_world->m_state_index;
+	Policy policy;
+	policy.init(&index);
+
+	// Reachable states only when asked for, all of them if the search fails
+	Reachable_States reachable;
+	if (m_reachable && !reachable.compute(*m_world, "dqn", (int)std::thread::hardware_concurrency())) {
+		reachable.m_states.clear();
+	}
+	auto set = [&](int64_t idx) {
+		int64_t state[5];
+		index.state(idx, state);
+		policy.set(idx, m_Net->select_action(convert_vector_to_tensor(std::vector<int64_t>(state, state + 5)), valid_actions(state)));
+	};
+	if (!reachable.m_states.empty()) {
+		for (int64_t idx : reachable.m_states) {
+			if (idx % index.m_n_actions < m_action_dim) {
+				set(idx);
+			}
+		}
+	}
+	else {
+		for (int64_t idx = 0; idx < index.size(); ++idx) {
+			if (idx % index.m_n_actions < m_action_dim && index.is_exported(idx)) {
+				set(idx);
 			}
 		}
 	}
-	myfile.close();
+	policy.save_txt(path);
 }
 
-void deepQ::train() {
+bool deepQ::train(bool resume) {
 	int64_t action;
 	torch::optim::SGD optimizer(m_Net->parameters(), /*lr=*/0.0001);
-	int posCount = 0;
-	int negCount = 0;
-	int zeroCount = 0;
-	int bestScore = 0;
-	int scoreSum = 0;
-	for (int epi_idx = 0; epi_idx < MAX_EPISODE; epi_idx++) {
+	DQN_Progress progress;
+	memset(&progress, 0, sizeof(progress));
+
+	// Training health, flushed by the metrics thread to MODEL_PATH
+	const int episodes = Metrics::counter((m_metric_prefix + "dqn_episodes").c_str());
+	const int steps = Metrics::counter((m_metric_prefix + "dqn_steps").c_str());
+	const int positive_rewards = Metrics::counter((m_metric_prefix + "dqn_positive_rewards").c_str());
+	const int zero_rewards = Metrics::counter((m_metric_prefix + "dqn_zero_rewards").c_str());
+	const int negative_rewards = Metrics::counter((m_metric_prefix + "dqn_negative_rewards").c_str());
+	const int score = Metrics::gauge((m_metric_prefix + "dqn_score").c_str());
+	const int mean_score = Metrics::gauge((m_metric_prefix + "dqn_mean_score").c_str());
+	const int best_score = Metrics::gauge((m_metric_prefix + "dqn_best_score").c_str());
+	const int loss_value = Metrics::gauge((m_metric_prefix + "dqn_loss").c_str());
+	const int step_ns = Metrics::histogram((m_metric_prefix + "dqn_step_ns").c_str());
+	std::error_code error;
+	std::filesystem::create_directories(MODEL_PATH, error);
+	if (resume && !load_checkpoint(MODEL_PATH + "checkpoint.bin", optimizer, progress)) {
+		m_world->destroy();
+		return false;
+	}
+	Metrics::start(MODEL_PATH);
+
+	for (int epi_idx = (int)progress.episode; epi_idx < MAX_EPISODE; epi_idx++) {
 		m_world->reset();
 		auto state = m_world->extract_state();
 		auto new_state = m_world->extract_state();
 		int reward = m_world->m_points;
 		int new_reward = m_world->m_points;
 		for (int t = 0; t < MAX_TIME; t++) {
+			TRACE_ZONE("dqn_step");
+			auto step_start = std::chrono::steady_clock::now();
 			state = new_state;
 			reward = new_reward;
-			double r = ((double)rand() / (RAND_MAX));
+			double r = (double)m_rng() / m_rng.max();
 			auto test = ((MAX_EPISODE * 1.0 - epi_idx) / MAX_EPISODE);
 			if (r < 0.05) {
-				// randomize action
-				action = rand() % m_action_dim;
+				// randomize action among the valid ones
+				action = Grid_World::pick_action(valid_actions(state.data()), m_rng());
 			}
 			else {
-				action = m_Net->select_action(convert_vector_to_tensor(state));
+				TRACE_ZONE("select_action");
+				action = m_Net->select_action(convert_vector_to_tensor(state), valid_actions(state.data()));
 			}
 			m_world->update(action);
 			new_state = m_world->extract_state();
@@ -101,8 +292,8 @@ void deepQ::train() {
 			//m_replay_buffer.add_experience(state, new_state, action, reward_diff);
 			int actual_reward = reward_diff;
 			if (action <= 4) {
-				int current_dist = std::max(abs(new_state.at(0) - new_state.at(2)), abs(new_state.at(1) - new_state.at(3)));
-				int prev_dist = std::max(abs(state.at(0) - state.at(2)), abs(state.at(1) - state.at(3)));
+				int current_dist = hero_enemy_distance(m_world->m_distances, new_state);
+				int prev_dist = hero_enemy_distance(m_world->m_distances, state);
 
 				actual_reward += 50 * (prev_dist - current_dist);
 			}
@@ -111,73 +302,79 @@ void deepQ::train() {
 					actual_reward -= 100;
 				}
 			}
-			else {
-				if (reward_diff == 0) {
-					actual_reward -= 50;
-				}
-			}
 
 			if (reward_diff > 0) {
 				for (int i = 0; i < 20; i++) {
 					m_replay_buffer.add_experience(state, new_state, action, actual_reward);
 				}
-				posCount++;
+				progress.positive++;
+				Metrics::add(positive_rewards);
 			}
 			else if (reward_diff == 0) {
 				m_replay_buffer.add_experience(state, new_state, action, actual_reward);
-				zeroCount++;
+				progress.zero++;
+				Metrics::add(zero_rewards);
 			}
 			else {
 				for (int i = 0; i < 20; i++) {
 					m_replay_buffer.add_experience(state, new_state, action, actual_reward);
 				}
-				negCount++;
+				progress.negative++;
+				Metrics::add(negative_rewards);
 			}
 			if (m_replay_buffer.num_experiences() >= BATCH_SIZE) {
-				std::vector<deepQ::Experience> batch = m_replay_buffer.sample_experiences(BATCH_SIZE);
-				torch::Tensor states_prev = torch::zeros({ BATCH_SIZE, (long)batch[0].state_prev.size() });
-				torch::Tensor states_next = torch::zeros({ BATCH_SIZE, (long)batch[0].state_next.size() });
-				torch::Tensor actions = torch::zeros({ BATCH_SIZE });
-				torch::Tensor rewards = torch::zeros({ BATCH_SIZE });
-
-				auto access_states_prev = states_prev.accessor<float, 2>();
-				auto access_states_next = states_next.accessor<float, 2>();
-				auto access_actions = actions.accessor<float, 1>();
-				auto access_rewards = rewards.accessor<float, 1>();
-
-				for (int sample = 0; sample < BATCH_SIZE; ++sample) {
-					for (int elem = 0; elem < batch[0].state_prev.size(); ++elem) {
-						access_states_prev[sample][elem] = batch[sample].state_prev.at(elem);
-						access_states_next[sample][elem] = batch[sample].state_next.at(elem);
-					}
-					access_actions[sample] = batch[sample].action;
-					access_rewards[sample] = batch[sample].reward;
+				std::vector<int> batch;
+				{
+					TRACE_ZONE("replay_sample");
+					batch = m_replay_buffer.sample_experiences(BATCH_SIZE, m_rng);
+				}
+				torch::Tensor states_prev, states_next, actions, rewards, offsets;
+				{
+					TRACE_ZONE("batch_assembly");
+					make_batch(m_replay_buffer, batch, states_prev, states_next, actions, rewards);
+					offsets = invalid_offsets(batch);
 				}
 
-				auto prediction = m_Net->forward(states_prev);
-				auto idx = actions.to(torch::kLong);
-				auto indices = idx.unsqueeze(1).expand_as(prediction);
-				auto result = at::gather(prediction, 1, indices);
-				auto results = result.slice(-1, 0, BATCH_SIZE, 13);
+				torch::Tensor loss;
+				{
+					TRACE_ZONE("forward");
+					auto prediction = m_Net->forward(states_prev);
+					auto idx = actions.to(torch::kLong);
+					auto indices = idx.unsqueeze(1).expand_as(prediction);
+					auto result = at::gather(prediction, 1, indices);
+					auto results = result.slice(-1, 0, BATCH_SIZE, 13);
 
-				auto expected_reward = m_Target->forward(states_next).max_values(1).detach() * GAMMA + rewards;
-				torch::Tensor loss = torch::mse_loss(results, expected_reward);
-				auto watch = torch::max(m_Net->fc1->named_parameters()["weight"]).item<float>();
-				optimizer.zero_grad();
-				loss.backward();
-				optimizer.step();
+					auto expected_reward = (m_Target->forward(states_next) + offsets).max_values(1).detach() * GAMMA + rewards;
+					loss = torch::mse_loss(results, expected_reward);
+					auto watch = torch::max(m_Net->fc1->named_parameters()["weight"]).item<float>();
+					Metrics::set(loss_value, loss.item<float>());
+				}
+				{
+					TRACE_ZONE("backward");
+					optimizer.zero_grad();
+					loss.backward();
+				}
+				{
+					TRACE_ZONE("optimizer_step");
+					optimizer.step();
+				}
 
 				if (epi_idx % TARGET_UPDATE == 0) {
 					// m_world->draw();
 					// Sleep(5.0);
 				}
 			}
-			
+
+			Metrics::add(steps);
+			Metrics::record(step_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - step_start).count());
 		}
 
-		scoreSum += m_world->m_points;
+		progress.score_sum += m_world->m_points;
+		Metrics::add(episodes);
+		Metrics::set(score, m_world->m_points);
 		
 		if (epi_idx % TARGET_UPDATE == 0) {
+			TRACE_ZONE_ALWAYS("checkpoint");
 			std::cout << "Current episode: " << epi_idx << std::endl;
 			std::cout << "Score: " << m_world->m_points << std::endl;
 			torch::serialize::OutputArchive output_archive;
@@ -188,22 +385,25 @@ void deepQ::train() {
 			input_archive.load_from(MODEL_PATH + "model.pt");
 			m_Target->load(input_archive);
 			// std::cout << m_Target->fc1->named_parameters()["weight"] << "\n";
-			if (bestScore < m_world->m_points) {
-				bestScore = m_world->m_points;
+			if (progress.best_score < m_world->m_points) {
+				progress.best_score = m_world->m_points;
 				torch::serialize::OutputArchive output_archive;
 				m_Net->save(output_archive);
-				output_archive.save_to(MODEL_PATH + "model_" + std::to_string(bestScore) + ".pt");
+				output_archive.save_to(MODEL_PATH + "model_" + std::to_string(progress.best_score) + ".pt");
+				Metrics::set(best_score, progress.best_score);
 			}
-			std::ofstream myfile;
-			myfile.open(MODEL_PATH + "result.csv", std::ios_base::app);
-			myfile << std::to_string(epi_idx) << "," << std::to_string(scoreSum*1.0 / TARGET_UPDATE) << std::endl;
-			myfile.close();
-			scoreSum = 0;
+			Metrics::set(mean_score, progress.score_sum*1.0 / TARGET_UPDATE);
+			progress.score_sum = 0;
+			progress.episode = epi_idx + 1;
+			checkpoint(optimizer, progress);
 		}
 	}
-	std::cout << "pos: " << posCount << std::endl;
-	std::cout << "zero: " << zeroCount << std::endl;
-	std::cout << "neg: " << negCount << std::endl;
+	progress.episode = MAX_EPISODE;
+	checkpoint(optimizer, progress);
+	bool written = m_writer.flush();
+	std::cout << "pos: " << progress.positive << std::endl;
+	std::cout << "zero: " << progress.zero << std::endl;
+	std::cout << "neg: " << progress.negative << std::endl;
 	std::string filename_policy;
 	if (m_world->m_enemy_type == 0) {
 		filename_policy = std::string("bat-") + m_world->m_level_name + std::string("-dqn_policy.txt");
@@ -214,6 +414,11 @@ void deepQ::train() {
 	else if (m_world->m_enemy_type  == 2) {
 		filename_policy = std::string("knight-") + m_world->m_level_name + std::string("-dqn_policy.txt");
 	}
+	else if (m_world->m_enemy_type  == 3) {
+		filename_policy = std::string("pathfinder-") + m_world->m_level_name + std::string("-dqn_policy.txt");
+	}
 	save_as_txt(policies_path(filename_policy));
+	Metrics::stop();
 	m_world->destroy();
+	return written;
 }
\ No newline at end of file
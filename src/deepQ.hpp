@@ -2,22 +2,58 @@
 
 #include <torch/torch.h>
 #include "grid_world.hpp"
+#include "async_writer.hpp"
 
 #include <algorithm>
 #include <random>
 
+// Where train() is, besides the nets and the replay buffer
+struct DQN_Progress
+{
+	uint64_t episode;		// next episode to run
+	int32_t positive;		// steps by reward sign
+	int32_t zero;
+	int32_t negative;
+	int32_t best_score;
+	int32_t score_sum;		// since the last target update
+	int32_t reserved;
+};
+
+// Learner checkpoint. The header is followed by the torch archive of the net, the target net and
+// the optimizer at CHECKPOINT_DATA, then by the replay buffer arrays at replay_offset in
+// ReplayBuffer order: states_prev, states_next, actions, rewards.
+struct DQN_Checkpoint_Header
+{
+	char magic[4];			// "DQNC"
+	uint32_t version;
+	uint64_t level_hash;	// Level::hash() of the level trained on
+	DQN_Progress progress;
+	uint32_t replay_size;	// capacity of the replay arrays
+	uint32_t reserved;
+	int64_t replay_count;	// experiences added so far
+	uint64_t archive_size;
+	uint64_t replay_offset;
+	char rng[2][8192];		// textual states of the trainer's and the world's generators
+};
+
 class deepQ
 {
 public:
-	deepQ(Grid_World* grid_world);
+	// Checkpoints, metrics and the target net round trip live under model_path. reachable limits
+	// the exported policy to the states reachable from the start states (Reachable_States).
+	// metric_prefix is put in front of the metric names, so trainers running side by side keep
+	// their own
+	deepQ(Grid_World* grid_world, std::string model_path = "./deepQ/", bool reachable = false, std::string metric_prefix = "");
 
-	void train();
+	// Checkpoints the whole learner to model_path/checkpoint.bin every TARGET_UPDATE episodes,
+	// resume continues exactly where the last one left off. The world is released whether it
+	// succeeds or not.
+	bool train(bool resume = false);
 
 	void load(std::string path);
 
 	void save_as_txt(std::string path);
 
-private:
 	struct Net :torch::nn::Module {
 		Net(int state_size, int action_size) {
 			m_state_size = state_size;
@@ -32,9 +68,20 @@ private:
 			return x;
 		}
 
-		int select_action(torch::Tensor state) {
+		// Highest valued action among those set in valid, action 0 always is
+		int select_action(torch::Tensor state, uint32_t valid = ~0u) {
 			auto x = forward(state);
-			return x.argmax(0).item().toInt();
+			if (valid == ~0u)
+				return x.argmax(0).item().toInt();
+			torch::Tensor values = x.detach();
+			auto access_values = values.accessor<float, 1>();
+			int best = 0;
+			for (int action = 1; action < m_action_size; ++action) {
+				if (((valid >> action) & 1) && access_values[action] > access_values[best]) {
+					best = action;
+				}
+			}
+			return best;
 		}
 
 		int m_state_size, m_action_size;
@@ -42,58 +89,84 @@ private:
 		torch::nn::Linear fc1{ nullptr }, fc2{ nullptr };
 	};
 
-	struct Experience {
-		std::vector<int64_t> state_prev;
-		std::vector<int64_t> state_next;
-		int64_t action; 
-		int reward;
-
-		Experience(std::vector<int64_t> state_prev, std::vector<int64_t> state_next, int64_t action, int reward) {
-			this->state_prev = state_prev;
-			this->state_next = state_next;
-			this->action = action;
-			this->reward = reward;
-		}
-	};
-
+	// Ring of the last size experiences, one contiguous array per field so a checkpoint can
+	// store and map them back as they are
 	struct ReplayBuffer {
-		std::vector<Experience> experiences;
-		int n_exp;
+		static const int STATE_SIZE = 5;
 		const int size = 10000;
+		std::vector<int32_t> states_prev; // size x STATE_SIZE
+		std::vector<int32_t> states_next;
+		std::vector<int32_t> actions;
+		std::vector<int32_t> rewards;
+		int64_t n_exp;
+
 		ReplayBuffer() {
-			experiences.reserve(size);
+			states_prev.resize((size_t)size * STATE_SIZE);
+			states_next.resize((size_t)size * STATE_SIZE);
+			actions.resize(size);
+			rewards.resize(size);
 			n_exp = 0;
 		}
 
-		void add_experience(std::vector<int64_t> state_prev, std::vector<int64_t> state_next, int64_t action, int reward) {
-			Experience experience = Experience(state_prev, state_next, action, reward);
-			if (experiences.size() < size) {
-				experiences.push_back(experience);
-			}
-			else {
-				experiences[n_exp % size] = experience;
+		void add_experience(const std::vector<int64_t>& state_prev, const std::vector<int64_t>& state_next, int64_t action, int reward) {
+			int slot = (int)(n_exp % size);
+			for (int i = 0; i < STATE_SIZE; ++i) {
+				states_prev[(size_t)slot * STATE_SIZE + i] = (int32_t)state_prev[i];
+				states_next[(size_t)slot * STATE_SIZE + i] = (int32_t)state_next[i];
 			}
+			actions[slot] = (int32_t)action;
+			rewards[slot] = reward;
 			n_exp++;
 		}
 
-		int num_experiences() {
+		int64_t num_experiences() {
 			return n_exp;
 		}
 
-	    std::vector<Experience> sample_experiences(int batch_size) {
-	    	int off = n_exp > size ? size : n_exp;
-    	    std::vector<Experience> batch;
-			std::sample(experiences.begin(), experiences.begin() + off, std::back_inserter(batch),
-            batch_size, std::mt19937{std::random_device{}()});
-            return batch;
-        }
+		// batch_size distinct filled slots (Floyd's sampling)
+		std::vector<int> sample_experiences(int batch_size, std::mt19937& rng) {
+			int off = n_exp > size ? size : (int)n_exp;
+			std::vector<int> batch;
+			batch.reserve(batch_size);
+			for (int j = off - batch_size; j < off; ++j) {
+				int slot = (int)(rng() % (uint32_t)(j + 1));
+				if (std::find(batch.begin(), batch.end(), slot) != batch.end()) {
+					slot = j;
+				}
+				batch.push_back(slot);
+			}
+			return batch;
+		}
 	};
 
+	// Stacks the sampled slots into [batch, state] / [batch] tensors
+	static void make_batch(const ReplayBuffer& buffer, const std::vector<int>& batch, torch::Tensor& states_prev, torch::Tensor& states_next, torch::Tensor& actions, torch::Tensor& rewards);
+
+private:
+	static const size_t CHECKPOINT_DATA = 20480;
+	static_assert(sizeof(DQN_Checkpoint_Header) <= CHECKPOINT_DATA, "checkpoint header overlaps the archive");
+
+	// Snapshots the learner on this thread and hands the bytes to m_writer
+	void checkpoint(torch::optim::Optimizer& optimizer, const DQN_Progress& progress);
+
+	bool load_checkpoint(const std::string& path, torch::optim::Optimizer& optimizer, DQN_Progress& progress);
+
+	// [batch, m_action_dim], added to the target values of the sampled next states before their
+	// max: 0 for the valid actions (Grid_World::valid_actions), a large negative value for the others
+	torch::Tensor invalid_offsets(const std::vector<int>& batch) const;
+
+	// Valid actions of state among the m_action_dim the net scores
+	uint32_t valid_actions(const int64_t* state) const { return m_world->valid_actions(state) & ((1u << m_action_dim) - 1); }
+
 	torch::Tensor Q;
 	int m_action_dim = -1;
 	Grid_World* 	m_world;
+	bool m_reachable; // export the reachable states only
+	std::string m_metric_prefix;
 	ReplayBuffer m_replay_buffer;
 	std::shared_ptr<deepQ::Net> m_Net;
 	std::shared_ptr<deepQ::Net> m_Target;
 	std::string MODEL_PATH = "./deepQ/";
+	std::mt19937 m_rng; // exploration and replay sampling
+	Async_Writer m_writer;
 };
\ No newline at end of file
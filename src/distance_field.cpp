@@ -0,0 +1,187 @@
+// Header
+#include "distance_field.hpp"
+#include "common.hpp"
+
+// stdlib
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <stdio.h>
+#include <string.h>
+
+namespace
+{
+	// fn(i) for every i in [0, n), handed out one at a time to n_threads threads
+	template<typename Fn>
+	void parallel_for(int n, int n_threads, Fn fn)
+	{
+		std::atomic<int> next(0);
+		auto work = [&]() {
+			for (int i = next++; i < n; i = next++) {
+				fn(i);
+			}
+		};
+
+		n_threads = std::max(1, std::min(n_threads, n / 64));
+		std::vector<std::thread> threads;
+		for (int t = 1; t < n_threads; ++t) {
+			threads.emplace_back(work);
+		}
+		work();
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+	}
+}
+
+const uint16_t Distance_Field::UNREACHABLE;
+
+Distance_Field::Distance_Field() : m_rows(0), m_cols(0), m_n_free(0) { }
+
+bool Distance_Field::build(const Level& level, int n_threads)
+{
+	if (level.m_n_free > MAX_FREE) {
+		fprintf(stderr, "%d free cells, too many for a distance field\n", level.m_n_free);
+		return false;
+	}
+	m_rows = level.m_rows;
+	m_cols = level.m_cols;
+	m_n_free = level.m_n_free;
+	m_free_index.assign(level.m_free_index, level.m_free_index + m_rows * m_cols);
+	m_distances.assign((size_t)m_n_free * m_n_free, UNREACHABLE);
+
+	m_next_hops.assign((size_t)m_n_free * m_n_free, 0);
+
+	// One search per source cell, the queue holds free cell indices. Distances are symmetric, so
+	// the row of a source also leads every cell to it.
+	parallel_for(m_n_free, n_threads, [&](int source) {
+		std::vector<int32_t> queue(m_n_free);
+		uint16_t* row = &m_distances[(size_t)source * m_n_free];
+		size_t head = 0;
+		size_t tail = 0;
+		row[source] = 0;
+		queue[tail++] = source;
+		while (head < tail) {
+			int from = queue[head++];
+			int cell = level.m_free_cells[from];
+			uint8_t free = level.free_neighbors(cell / m_cols, cell % m_cols);
+			int neighbors[4] = { cell - m_cols, cell - 1, cell + m_cols, cell + 1 };
+			for (int d = 0; d < 4; ++d) {
+				if (!((free >> d) & 1))
+					continue;
+				int to = m_free_index[neighbors[d]];
+				if (row[to] == UNREACHABLE) {
+					row[to] = (uint16_t)(row[from] + 1);
+					queue[tail++] = to;
+				}
+			}
+		}
+		next_hops(level, source);
+	});
+	return true;
+}
+
+void Distance_Field::next_hops(const Level& level, int target)
+{
+	const uint16_t* row = &m_distances[(size_t)target * m_n_free];
+	uint8_t* hops = &m_next_hops[(size_t)target * m_n_free];
+	for (int from = 0; from < m_n_free; ++from) {
+		hops[from] = 0;
+		if (row[from] == UNREACHABLE || row[from] == 0)
+			continue;
+		int cell = level.m_free_cells[from];
+		uint8_t free = level.free_neighbors(cell / m_cols, cell % m_cols);
+		int neighbors[4] = { cell - m_cols, cell - 1, cell + m_cols, cell + 1 };
+		for (int d = 0; d < 4; ++d) {
+			if (((free >> d) & 1) && row[m_free_index[neighbors[d]]] + 1 == row[from]) {
+				hops[from] = (uint8_t)(d + 1);
+				break;
+			}
+		}
+	}
+}
+
+bool Distance_Field::load(const std::string& path, const Level& level)
+{
+	Mapped_File file;
+	if (!file.open(path.c_str()))
+		return false;
+
+	const Distance_Header* header = (const Distance_Header*)file.data;
+	size_t n = (size_t)level.m_n_free * level.m_n_free;
+	if (file.size != sizeof(Distance_Header) + n * sizeof(uint16_t) || memcmp(header->magic, "DIST", 4) != 0 ||
+		header->version != 1 || header->level_hash != level.hash() || header->n_free != (uint32_t)level.m_n_free) {
+		return false;
+	}
+
+	m_rows = level.m_rows;
+	m_cols = level.m_cols;
+	m_n_free = level.m_n_free;
+	m_free_index.assign(level.m_free_index, level.m_free_index + m_rows * m_cols);
+	m_distances.resize(n);
+	memcpy(m_distances.data(), file.data + sizeof(Distance_Header), n * sizeof(uint16_t));
+	m_next_hops.assign(n, 0);
+	parallel_for(m_n_free, (int)std::thread::hardware_concurrency(), [&](int target) {
+		next_hops(level, target);
+	});
+	return true;
+}
+
+bool Distance_Field::save(const std::string& path, uint64_t level_hash) const
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr) {
+		fprintf(stderr, "Failed to open %s for writing\n", path.c_str());
+		return false;
+	}
+
+	Distance_Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "DIST", 4);
+	header.version = 1;
+	header.level_hash = level_hash;
+	header.n_free = (uint32_t)m_n_free;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && fwrite(m_distances.data(), sizeof(uint16_t), m_distances.size(), file) == m_distances.size();
+	ok = fclose(file) == 0 && ok;
+	if (!ok) {
+		fprintf(stderr, "Failed to write %s\n", path.c_str());
+	}
+	return ok;
+}
+
+const Distance_Field* Distance_Field::shared(const Level& level)
+{
+	static std::mutex mutex;
+	static std::map<uint64_t, std::unique_ptr<Distance_Field>> fields;
+
+	if (level.m_n_free > MAX_FREE)
+		return nullptr;
+
+	uint64_t hash = level.hash();
+	std::lock_guard<std::mutex> lock(mutex);
+	std::unique_ptr<Distance_Field>& field = fields[hash];
+	if (field == nullptr) {
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)hash);
+		std::string path = std::string(data_path "/distances") + name;
+
+		std::unique_ptr<Distance_Field> loaded(new Distance_Field());
+		if (!loaded->load(path, level)) {
+			if (!loaded->build(level, (int)std::thread::hardware_concurrency())) {
+				fields.erase(hash);
+				return nullptr;
+			}
+			// A missing cache only costs the next run the searches
+			std::error_code error;
+			std::filesystem::create_directories(data_path "/distances", error);
+			loaded->save(path, hash);
+		}
+		field = std::move(loaded);
+	}
+	return field.get();
+}
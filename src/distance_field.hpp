@@ -0,0 +1,83 @@
+#pragma once
+
+#include "level.hpp"
+
+// stdlib
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Header of the distance caches in data/distances, followed by n_free^2 uint16 distances
+struct Distance_Header
+{
+	char magic[4];			// "DIST"
+	uint32_t version;
+	uint64_t level_hash;	// Level::hash()
+	uint32_t n_free;
+	uint32_t reserved;
+};
+
+// Shortest path lengths between every pair of free cells of a level, moving up, left, down or
+// right through free cells. One breadth-first search per free cell, split across threads, stored
+// as uint16 rows in free cell index order. Each search also gives the first move of a shortest
+// path from every cell to its source, the next hop table chasers step along.
+class Distance_Field
+{
+public:
+	static const uint16_t UNREACHABLE = 0xFFFF;
+
+	// n_free^2 distances and next hops, larger levels get no field
+	static const int MAX_FREE = 8192;
+
+	Distance_Field();
+
+	bool build(const Level& level, int n_threads);
+
+	// Cache files, rejected unless they were written for the same level
+	bool load(const std::string& path, const Level& level);
+	bool save(const std::string& path, uint64_t level_hash) const;
+
+	// Field of level read from data/distances/<level hash>.bin, or built on every core and written
+	// there, once for the whole process. nullptr for levels over MAX_FREE free cells. Safe to call
+	// from any thread.
+	static const Distance_Field* shared(const Level& level);
+
+	// Moves from one cell to the other, UNREACHABLE if either is not free or they are not connected
+	int distance(int from_row, int from_col, int to_row, int to_col) const
+	{
+		if ((unsigned)from_row >= (unsigned)m_rows || (unsigned)from_col >= (unsigned)m_cols ||
+			(unsigned)to_row >= (unsigned)m_rows || (unsigned)to_col >= (unsigned)m_cols)
+			return UNREACHABLE;
+		int from = m_free_index[from_row * m_cols + from_col];
+		int to = m_free_index[to_row * m_cols + to_col];
+		if (from < 0 || to < 0)
+			return UNREACHABLE;
+		return m_distances[(size_t)from * m_n_free + to];
+	}
+
+	// Move action (1-4) from one cell onto a shortest path to the other, the first free one in
+	// action order when there are several. 0 if they are the same cell or not connected.
+	int next_hop(int from_row, int from_col, int to_row, int to_col) const
+	{
+		if ((unsigned)from_row >= (unsigned)m_rows || (unsigned)from_col >= (unsigned)m_cols ||
+			(unsigned)to_row >= (unsigned)m_rows || (unsigned)to_col >= (unsigned)m_cols)
+			return 0;
+		int from = m_free_index[from_row * m_cols + from_col];
+		int to = m_free_index[to_row * m_cols + to_col];
+		if (from < 0 || to < 0)
+			return 0;
+		return m_next_hops[(size_t)to * m_n_free + from];
+	}
+
+	int m_rows;
+	int m_cols;
+	int m_n_free;
+
+private:
+	// Next hops towards target from the distances of its row
+	void next_hops(const Level& level, int target);
+
+	std::vector<int32_t> m_free_index; // Level::m_free_index
+	std::vector<uint16_t> m_distances;
+	std::vector<uint8_t> m_next_hops; // per target, per source cell, rebuilt when a cache is loaded
+};
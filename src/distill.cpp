@@ -0,0 +1,221 @@
+// Header
+#include "distill.hpp"
+#include "dqn_model.hpp"
+#include "mapped_file.hpp"
+
+// stdlib
+#include <algorithm>
+#include <ctype.h>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+
+namespace
+{
+	const char* ENEMY_NAMES[4] = { "bat", "skeleton", "knight", "pathfinder" };
+
+	// C identifier of a table name, "bat-level_2-dqn" -> "bat_level_2_dqn"
+	std::string identifier(const std::string& name)
+	{
+		std::string id = name;
+		for (char& c : id) {
+			if (!isalnum((unsigned char)c)) {
+				c = '_';
+			}
+		}
+		return id;
+	}
+
+	// 0 when there is no such file
+	int64_t modification_time(const std::string& path)
+	{
+		std::error_code error;
+		std::filesystem::file_time_type time = std::filesystem::last_write_time(path, error);
+		return error ? 0 : (int64_t)time.time_since_epoch().count();
+	}
+
+	// FNV-1a of the file, as Policy::hash() over bytes
+	uint64_t file_hash(const std::string& path)
+	{
+		uint64_t hash = 14695981039346656037ull;
+		Mapped_File file;
+		if (!file.open(path.c_str()))
+			return hash;
+		for (size_t i = 0; i < file.size; ++i) {
+			hash = (hash ^ file.data[i]) * 1099511628211ull;
+		}
+		return hash;
+	}
+
+	bool is_model(const std::string& path)
+	{
+		return path.size() > 3 && path.compare(path.size() - 3, 3, ".pt") == 0;
+	}
+
+	// Hash of the source at path as distill stamps it, kept per path until the file changes so
+	// worlds of the same level parse a newer text policy once
+	uint64_t source_hash(const std::string& path, int64_t time, const State_Index& index)
+	{
+		static std::mutex mutex;
+		static std::map<std::string, Source_Stamp> stamps;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		Source_Stamp& stamp = stamps[path];
+		if (stamp.time != time) {
+			if (is_model(path)) {
+				stamp.hash = file_hash(path);
+			}
+			else {
+				Policy source;
+				source.init(&index);
+				stamp.hash = source.load_txt(path) ? source.hash() : 0;
+			}
+			stamp.time = time;
+		}
+		return stamp.hash;
+	}
+}
+
+std::string Distiller::source_path(int enemy_type, const std::string& level_name, const std::string& algo)
+{
+	std::string model = DQN_Model::directory(enemy_type, level_name) + "model.pt";
+	if (algo == "dqn" && modification_time(model) != 0)
+		return model;
+	return policies_path(std::string(ENEMY_NAMES[enemy_type]) + "-" + level_name + "-" + algo + "_policy.txt");
+}
+
+bool Distiller::is_current(const Policy& table, const Grid_World& world, int enemy_type, const std::string& algo)
+{
+	std::string path = source_path(enemy_type, world.m_level_name, algo);
+	int64_t time = modification_time(path);
+	if (time == 0 || time <= table.m_source.time)
+		return true;
+	if (source_hash(path, time, world.m_state_index) == table.m_source.hash)
+		return true;
+	fprintf(stderr, "%s changed since the table was distilled from it, distill it again\n", path.c_str());
+	return false;
+}
+
+bool Distiller::build(Grid_World& world, int enemy_type, const std::string& algo)
+{
+	m_name = std::string(ENEMY_NAMES[enemy_type]) + "-" + world.m_level_name + "-" + algo;
+	m_level_hash = world.m_level.hash();
+	const State_Index& index = world.m_state_index;
+
+	DQN_Model model;
+	Policy source;
+	m_source = source_path(enemy_type, world.m_level_name, algo);
+	if (is_model(m_source) && model.load(m_source)) {
+		model.attach(source, world);
+		m_source_stamp.hash = file_hash(m_source);
+	}
+	else {
+		m_source = policies_path(m_name + "_policy.txt");
+		source.init(&index);
+		if (!source.load_txt(m_source))
+			return false;
+		m_source_stamp.hash = source.hash();
+	}
+	m_source_stamp.time = modification_time(m_source);
+
+	m_policy.init(&index);
+	m_n_exported = 0;
+	int64_t state[5];
+	for (int64_t idx = 0; idx < index.size(); ++idx) {
+		if (!index.is_exported(idx))
+			continue;
+		index.state(idx, state);
+		m_policy.set(idx, source.action((int)state[0], (int)state[1], (int)state[2], (int)state[3], (int)state[4]));
+		m_n_exported++;
+	}
+	// Lookups outside the index answer from these lines in the source, so they do in the table
+	m_policy.set_outside_lines(source.outside_lines());
+	return true;
+}
+
+bool Distiller::save_table(const std::string& path) const
+{
+	return m_policy.save_packed(path, m_level_hash, m_source_stamp);
+}
+
+bool Distiller::save_header(const std::string& directory) const
+{
+	std::error_code error;
+	std::filesystem::create_directories(directory, error);
+
+	std::string path = directory + m_name + ".hpp";
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr) {
+		fprintf(stderr, "Failed to open %s for writing\n", path.c_str());
+		return false;
+	}
+
+	std::string id = identifier(m_name);
+	std::vector<uint8_t> packed = m_policy.pack();
+	fprintf(file, "// Generated by distill from %s, do not edit\n#pragma once\n\n#include <stdint.h>\n\n", m_source.c_str());
+	fprintf(file, "namespace generated\n{\n");
+	fprintf(file, "\tconstexpr uint64_t %s_level_hash = 0x%016llxull;\n", id.c_str(), (unsigned long long)m_level_hash);
+	fprintf(file, "\tconstexpr uint64_t %s_source_hash = 0x%016llxull;\n", id.c_str(), (unsigned long long)m_source_stamp.hash);
+	fprintf(file, "\tconstexpr int64_t %s_source_time = %lldll;\n", id.c_str(), (long long)m_source_stamp.time);
+	fprintf(file, "\tconstexpr int64_t %s_states = %lld;\n", id.c_str(), (long long)m_policy.m_actions.size());
+	fprintf(file, "\tconstexpr uint8_t %s[%zu] = {", id.c_str(), packed.size());
+	for (size_t i = 0; i < packed.size(); ++i) {
+		fprintf(file, i % 16 == 0 ? "\n\t\t0x%02x," : " 0x%02x,", packed[i]);
+	}
+	fprintf(file, "\n\t};\n");
+
+	const std::vector<std::pair<int64_t, uint8_t>>& outside = m_policy.outside_lines();
+	fprintf(file, "\tconstexpr int64_t %s_n_outside = %zu;\n", id.c_str(), outside.size());
+	if (outside.empty()) {
+		fprintf(file, "\tconstexpr const int64_t* %s_outside_states = nullptr;\n", id.c_str());
+		fprintf(file, "\tconstexpr const uint8_t* %s_outside_actions = nullptr;\n", id.c_str());
+	}
+	else {
+		fprintf(file, "\tconstexpr int64_t %s_outside_states[%zu] = {", id.c_str(), outside.size());
+		for (size_t i = 0; i < outside.size(); ++i) {
+			fprintf(file, i % 8 == 0 ? "\n\t\t%lldll," : " %lldll,", (long long)outside[i].first);
+		}
+		fprintf(file, "\n\t};\n\tconstexpr uint8_t %s_outside_actions[%zu] = {", id.c_str(), outside.size());
+		for (size_t i = 0; i < outside.size(); ++i) {
+			fprintf(file, i % 16 == 0 ? "\n\t\t0x%02x," : " 0x%02x,", outside[i].second);
+		}
+		fprintf(file, "\n\t};\n");
+	}
+	fprintf(file, "}\n");
+	bool ok = fclose(file) == 0;
+
+	// The registry lists whatever tables the directory holds
+	std::vector<std::string> names;
+	for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+		std::string filename = entry.path().filename().string();
+		if (entry.path().extension() == ".hpp" && filename != "policies.hpp") {
+			names.push_back(entry.path().stem().string());
+		}
+	}
+	std::sort(names.begin(), names.end());
+
+	std::string registry_path = directory + "policies.hpp";
+	FILE* registry = fopen(registry_path.c_str(), "wb");
+	if (registry == nullptr) {
+		fprintf(stderr, "Failed to open %s for writing\n", registry_path.c_str());
+		return false;
+	}
+	fprintf(registry, "// Generated by distill, lists the tables of this directory, do not edit\n#pragma once\n\n");
+	for (const std::string& name : names) {
+		fprintf(registry, "#include \"%s.hpp\"\n", name.c_str());
+	}
+	fprintf(registry, "\nstatic const Compiled_Policy COMPILED_POLICIES[] = {\n");
+	for (const std::string& name : names) {
+		std::string table = "generated::" + identifier(name);
+		const char* t = table.c_str();
+		fprintf(registry, "\t{ \"%s\", %s_level_hash, { %s_source_hash, %s_source_time }, %s_states, %s, %s_n_outside, %s_outside_states, %s_outside_actions },\n",
+			name.c_str(), t, t, t, t, t, t, t, t);
+	}
+	fprintf(registry, "};\n");
+	ok = fclose(registry) == 0 && ok;
+	if (!ok) {
+		fprintf(stderr, "Failed to write %s\n", path.c_str());
+	}
+	return ok;
+}
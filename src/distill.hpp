@@ -0,0 +1,40 @@
+#pragma once
+
+#include "grid_world.hpp"
+#include "policy.hpp"
+
+// stdlib
+#include <string>
+
+// Turns a trained hero policy into the 4-bit table enemies play. Every exported state of the
+// level's index is evaluated once, from the dqn model when there is one or from the exported
+// text policy (the Q-table argmax for tabq), so the result no longer depends on a net or a
+// text parse at startup.
+class Distiller
+{
+public:
+	// Policy the hero trained with algo against enemy_type on the world's level
+	bool build(Grid_World& world, int enemy_type, const std::string& algo);
+
+	// The dqn model of enemy_type on level_name when algo is dqn and there is one, the exported
+	// text policy otherwise
+	static std::string source_path(int enemy_type, const std::string& level_name, const std::string& algo);
+
+	// False when the source of a table distilled for enemy_type on the world's level changed since:
+	// it is newer than the table and hashes differently. A table without its source around is current.
+	static bool is_current(const Policy& table, const Grid_World& world, int enemy_type, const std::string& algo);
+
+	// data/policies/<name>_policy.pk4
+	bool save_table(const std::string& path) const;
+
+	// directory/<name>.hpp with the table as a constexpr array, then directory/policies.hpp
+	// listing every table header of directory
+	bool save_header(const std::string& directory) const;
+
+	std::string m_name; // <enemy>-<level>-<algo>
+	std::string m_source; // model or text policy it was built from
+	Source_Stamp m_source_stamp;
+	uint64_t m_level_hash;
+	Policy m_policy;
+	int64_t m_n_exported;
+};
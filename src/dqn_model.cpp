@@ -0,0 +1,102 @@
+// Header
+#include "dqn_model.hpp"
+#include "deepQ.hpp"
+
+// stdlib
+#include <filesystem>
+#include <math.h>
+#include <stdio.h>
+
+namespace
+{
+	const char* ENEMY_NAMES[4] = { "bat", "skeleton", "knight", "pathfinder" };
+
+	void copy(const torch::Tensor& tensor, std::vector<float>& out)
+	{
+		torch::Tensor values = tensor.contiguous();
+		const float* data = values.data_ptr<float>();
+		out.assign(data, data + values.numel());
+	}
+}
+
+DQN_Model::DQN_Model() :
+	m_hidden(0),
+	m_action_dim(0)
+{
+}
+
+bool DQN_Model::load(const std::string& path)
+{
+	m_action_dim = 0;
+	std::error_code error;
+	if (!std::filesystem::exists(path, error))
+		return false;
+
+	deepQ::Net net(STATE_SIZE, 9);
+	torch::serialize::InputArchive archive;
+	archive.load_from(path);
+	net.load(archive);
+
+	copy(net.fc1->weight, m_w1);
+	copy(net.fc1->bias, m_b1);
+	copy(net.fc2->weight, m_w2);
+	copy(net.fc2->bias, m_b2);
+	if ((int)m_b1.size() > MAX_HIDDEN) {
+		fprintf(stderr, "%s has more than %d hidden units\n", path.c_str(), MAX_HIDDEN);
+		return false;
+	}
+	m_hidden = (int)m_b1.size();
+	m_action_dim = (int)m_b2.size();
+	return true;
+}
+
+int DQN_Model::action(const int64_t* state, uint32_t valid) const
+{
+	float x[STATE_SIZE];
+	for (int i = 0; i < STATE_SIZE; ++i) {
+		x[i] = (float)state[i];
+	}
+
+	float h[MAX_HIDDEN];
+	for (int j = 0; j < m_hidden; ++j) {
+		const float* w = &m_w1[(size_t)j * STATE_SIZE];
+		float sum = m_b1[j];
+		for (int i = 0; i < STATE_SIZE; ++i) {
+			sum += w[i] * x[i];
+		}
+		h[j] = 1.f / (1.f + expf(-sum));
+	}
+
+	// First maximum among the valid actions, as deepQ::Net::select_action does
+	int best = -1;
+	float best_value = 0.f;
+	for (int a = 0; a < m_action_dim; ++a) {
+		if (!((valid >> a) & 1))
+			continue;
+		const float* w = &m_w2[(size_t)a * m_hidden];
+		float sum = m_b2[a];
+		for (int j = 0; j < m_hidden; ++j) {
+			sum += w[j] * h[j];
+		}
+		if (best < 0 || sum > best_value) {
+			best_value = sum;
+			best = a;
+		}
+	}
+	return best < 0 ? 0 : best;
+}
+
+void DQN_Model::attach(Policy& policy, const Grid_World& world) const
+{
+	policy.init(&world.m_state_index);
+	// Enemy actions past the net's outputs were never exported either, they play 0
+	uint32_t outputs = (1u << m_action_dim) - 1;
+	policy.set_fill([this, &world, outputs](const int64_t* state) {
+		return state[4] < m_action_dim ? action(state, world.valid_actions(state) & outputs) : 0;
+	});
+}
+
+std::string DQN_Model::directory(int enemy_type, const std::string& level_name)
+{
+	return std::string("./deepQ/") + ENEMY_NAMES[enemy_type] + "-" + level_name + "/";
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "policy.hpp"
+#include "state_index.hpp"
+
+// stdlib
+#include <string>
+#include <vector>
+
+class Grid_World;
+
+// Weights of a trained deepQ::Net as plain float layers. A single state goes through the two
+// layers in a few hundred multiply-adds, without torch tensors, so the net can stand in for
+// its exported text policy when playing or evaluating.
+class DQN_Model
+{
+public:
+	static const int STATE_SIZE = 5;
+
+	DQN_Model();
+
+	// Reads a model.pt written by deepQ::train
+	bool load(const std::string& path);
+
+	bool loaded() const { return m_action_dim > 0; }
+
+	// Greedy action for the 5 components of extract_state(), among the actions set in valid
+	int action(const int64_t* state, uint32_t valid = ~0u) const;
+
+	// Sizes policy for the world's index and fills it from the net state by state on first use,
+	// among the valid actions of each state as deepQ exports them. The model and world have to
+	// outlive the policy.
+	void attach(Policy& policy, const Grid_World& world) const;
+
+	// Where deepQ::train of the enemy type and level keeps its checkpoints and model.pt
+	static std::string directory(int enemy_type, const std::string& level_name);
+
+private:
+	static const int MAX_HIDDEN = 64;
+
+	int m_hidden;
+	int m_action_dim;
+	std::vector<float> m_w1; // hidden x STATE_SIZE
+	std::vector<float> m_b1;
+	std::vector<float> m_w2; // action_dim x hidden
+	std::vector<float> m_b2;
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+// stdlib
+#include <stdint.h>
+
+// Side effect of a step, played back by the render / audio layer
+struct Game_Event
+{
+	enum Type : uint8_t
+	{
+		DAMAGE,		// hero ran into the enemy or was attacked
+		ATTACK_HIT,	// hero attack landed
+		GUARD,		// a guard held, points < 0 when the enemy blocked the hero
+		WIN,		// points went over the limit, the world was reset
+		LOSE		// points went under the limit, the world was reset
+	};
+
+	Type type;
+	int points;
+};
+
+// Events of the last step. A step emits at most a handful, the buffer never allocates and
+// pushes past the capacity are dropped.
+class Event_Buffer
+{
+public:
+	static const int CAPACITY = 8;
+
+	Event_Buffer() : m_count(0) { }
+
+	void clear() { m_count = 0; }
+
+	void push(Game_Event::Type type, int points = 0)
+	{
+		if (m_count < CAPACITY) {
+			m_events[m_count++] = { type, points };
+		}
+	}
+
+	int size() const { return m_count; }
+	const Game_Event* begin() const { return m_events; }
+	const Game_Event* end() const { return m_events + m_count; }
+
+private:
+	Game_Event m_events[CAPACITY];
+	int m_count;
+};
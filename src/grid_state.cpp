@@ -5,7 +5,7 @@
 Grid_State::Grid_State() { }
 Grid_State::~Grid_State() { }
 
-bool Grid_State::init(int row, int col, int tex_row, int tex_col, bool obstacle)
+bool Grid_State::init(int row, int col, int tex_row, int tex_col)
 {
 	TexturedVertex vertices[4];
 	vertices[0].position = { 0.f,  50.f };
@@ -45,9 +45,6 @@ bool Grid_State::init(int row, int col, int tex_row, int tex_col, bool obstacle)
 		return false; 
 	}
 
-	m_hero = false;
-	m_enemy = false;
-	m_obstacle = obstacle;
 	m_grid_position = {(float)row, (float)col};
 
 	return true;
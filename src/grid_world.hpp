@@ -5,6 +5,13 @@
 #include "grid_state.hpp"
 #include "hero.hpp"
 #include "enemy.hpp"
+#include "level.hpp"
+#include "state_index.hpp"
+#include "distance_field.hpp"
+#include "policy.hpp"
+#include "dqn_model.hpp"
+#include "game_event.hpp"
+#include "trace.hpp"
 
 // stdlib
 #include <string.h>
@@ -22,6 +29,15 @@
 #include <SDL.h>
 #include <SDL_mixer.h>
 
+// Enemy types, each has its own step kernel
+struct Bat {};
+struct Skeleton {};
+struct Knight {};
+struct Pathfinder {};
+
+// Values of Grid_World::m_enemy_type, tables indexed by it have this many entries
+const int N_ENEMY_TYPES = 4;
+
 // Container for all our entities and game logic. Individual rendering / update is 
 // deferred to the relative update() methods
 class Grid_World
@@ -38,8 +54,8 @@ public:
 	// Loads policy
 	bool load_policy(std::string filepath_policy);
 
-	// Loads level
-	bool load_level(std::string filename_level, std::vector<int> hero_pos, std::vector<int> enemy_pos, bool flag);
+	// Builds the renderable grid states of the parsed level
+	bool load_level(bool flag);
 
 	// Releases all associated resources
 	void destroy();
@@ -56,7 +72,69 @@ public:
 
 	void reset();
 
-	std::vector<int64_t> extract_state();
+	std::vector<int64_t> extract_state() const;
+
+	// Hero actions of an extract_state() that are not no-ops, bit a for action a: doing nothing,
+	// moving into a free cell, attacking or guarding toward an adjacent enemy. The others never score
+	// on their own, they only differ from doing nothing through collisions and the enemy's move.
+	// Read from the level's compiled neighbor masks.
+	uint16_t valid_actions(const int64_t* state) const
+	{
+		int hero_row = (int)state[0];
+		int hero_col = (int)state[1];
+		int d_row = (int)state[2] - hero_row;
+		int d_col = (int)state[3] - hero_col;
+		uint16_t valid = (uint16_t)(1 | (m_level.free_neighbors(hero_row, hero_col) << 1));
+		// up, left, down, right as in the actions
+		int direction = d_col == 0 ? (d_row == -1 ? 0 : d_row == 1 ? 2 : -1) : d_row == 0 ? (d_col == -1 ? 1 : d_col == 1 ? 3 : -1) : -1;
+		if (direction >= 0) {
+			valid |= (uint16_t)((1 << (5 + direction)) | (1 << (9 + direction)));
+		}
+		return valid;
+	}
+
+	// The (draw % count)-th of the count actions set in valid, for uniform exploration
+	static int pick_action(uint32_t valid, uint32_t draw)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		int count = __builtin_popcount(valid);
+#else
+		int count = 0;
+		for (uint32_t bits = valid; bits != 0; bits &= bits - 1) {
+			++count;
+		}
+#endif
+		int pick = (int)(draw % (uint32_t)count);
+		int action = 0;
+		for (; pick > 0 || !((valid >> action) & 1); ++action) {
+			pick -= (valid >> action) & 1;
+		}
+		return action;
+	}
+
+	// Hero and enemy cells of reset(), as (row, col)
+	std::vector<ivec2> start_cells() const;
+	void set_start_cells(ivec2 hero, ivec2 enemy);
+
+	// Seeds the world's own random draws (bat bounces, reset() enemy action)
+	void seed(unsigned seed) { m_rng.seed(seed); }
+
+	// The generator itself, checkpoints save and restore its state
+	std::mt19937& rng() { return m_rng; }
+
+	// Events of the last update(), trainers can ignore them
+	const Event_Buffer& events() const { return m_events; }
+
+	// Puts the hero and enemy on the 5 components of an extract_state(), to enumerate transitions
+	void set_state(const int64_t* state);
+
+	// bounce() takes outcome instead of sampling while it is >= 0, last_bounce() then tells
+	// which outcomes the steps since this call could have taken, nullptr if they did not bounce
+	void force_bounce(int outcome) { m_forced_bounce = outcome; m_last_bounce = nullptr; }
+	const Bounce* last_bounce() const { return m_last_bounce; }
+
+	// Policy the skeleton and the knight play, empty for the bat and the pathfinder
+	const Policy& enemy_policy() const { return m_policy; }
 
 	int m_enemy_type;
 
@@ -65,26 +143,57 @@ public:
 	int m_rows;
 	int m_cols;
 
+	Level m_level;
+	State_Index m_state_index; // all free cells, 13 enemy actions
+	const Distance_Field* m_distances; // shared by every world of the level, nullptr on levels too large for one
+
 	std::string m_level_name;
 
 private:
 	void on_key(GLFWwindow*, int key, int, int action, int mod);
 
-	int count_rows(std::string filename_level);
-	int count_cols(std::string filename_level);
+	// Body of update(), specialized per enemy type and selected once in init
+	template <typename Enemy_Type>
+	bool step();
+	// Skeleton rules, shared by the enemies that differ only in how they pick their next action
+	template <typename Enemy_Type>
+	bool step_melee();
+	// Next enemy action, picked once the step's cells are known
+	template <typename Enemy_Type>
+	int enemy_action(ivec2 cur_hero, ivec2 cur_enemy, ivec2 new_hero, ivec2 new_enemy) const;
+	bool end_step(ivec2 new_grid_position_hero, ivec2 new_grid_position_enemy);
+	ivec2 bounce(ivec2 cell, ivec2 direction);
+
+	// Plays the sounds of the last step's events
+	void play_events();
+
+	typedef bool (Grid_World::*Step_Fn)();
+	Step_Fn m_step;
+	std::mt19937 m_rng;
+	Event_Buffer m_events;
+	int m_forced_bounce;
+	const Bounce* m_last_bounce;
+	bool m_rendering; // window and audio are up, the game resets itself at +-1500 points
+
+	// Bitboard lookup, cells outside the grid are blocked
+	bool obstacle(ivec2 cell) const
+	{
+		return (unsigned)cell.x >= (unsigned)m_rows || (unsigned)cell.y >= (unsigned)m_cols || m_level.is_obstacle(cell.x, cell.y);
+	}
 
 private:
 	GLFWwindow* m_window;
 	float m_screen_scale; 
 
-	Grid_State**	m_grid_states;
+	Grid_State**	m_grid_states; // render only
 	Hero* 			m_hero;
 	Enemy* 			m_enemy;
 	bool 			m_is_over;
 
 	std::vector<int> m_hero_init_pos;
 	std::vector<int> m_enemy_init_pos;
-	std::vector<std::vector<std::vector<std::vector<std::vector<int>>>>> m_policy;
+	Policy m_policy;
+	DQN_Model m_model; // backs m_policy when the enemy plays a dqn model
 	
 	Mix_Music* 		m_background_music;
 	Mix_Chunk* 		m_lose_game;
@@ -93,3 +202,8 @@ private:
 	Mix_Chunk* 		m_win_points;
 	Texture 		m_world_texture;
 };
+
+template <> bool Grid_World::step<Bat>();
+template <> bool Grid_World::step<Skeleton>();
+template <> bool Grid_World::step<Knight>();
+template <> bool Grid_World::step<Pathfinder>();
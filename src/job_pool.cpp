@@ -0,0 +1,143 @@
+// Header
+#include "job_pool.hpp"
+
+// stdlib
+#include <algorithm>
+#include <thread>
+
+int Job_Pool::add(std::function<bool()> fn)
+{
+	std::unique_ptr<Job> job(new Job());
+	job->fn = std::move(fn);
+	m_jobs.push_back(std::move(job));
+	return (int)m_jobs.size() - 1;
+}
+
+void Job_Pool::depend(int job, int on)
+{
+	m_jobs[on]->dependents.push_back(job);
+	m_jobs[job]->n_dependencies++;
+}
+
+void Job_Pool::push(int worker, int job)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_workers[worker]->mutex);
+		m_workers[worker]->jobs.push_back(job);
+	}
+	std::lock_guard<std::mutex> lock(m_idle_mutex);
+	m_queued++;
+	m_wake.notify_one();
+}
+
+bool Job_Pool::pop(int worker, int& job)
+{
+	// Own jobs newest first, then the oldest of the others
+	int n = (int)m_workers.size();
+	for (int i = 0; i < n; ++i) {
+		Worker& victim = *m_workers[(worker + i) % n];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (victim.jobs.empty())
+			continue;
+		if (i == 0) {
+			job = victim.jobs.back();
+			victim.jobs.pop_back();
+		}
+		else {
+			job = victim.jobs.front();
+			victim.jobs.pop_front();
+		}
+		std::lock_guard<std::mutex> idle(m_idle_mutex);
+		m_queued--;
+		return true;
+	}
+	return false;
+}
+
+void Job_Pool::finish()
+{
+	std::lock_guard<std::mutex> lock(m_idle_mutex);
+	if (++m_finished == (int)m_jobs.size()) {
+		m_wake.notify_all();
+	}
+}
+
+void Job_Pool::skip(int job)
+{
+	int pending = PENDING;
+	if (!m_jobs[job]->state.compare_exchange_strong(pending, SKIPPED))
+		return;
+	finish();
+	for (int dependent : m_jobs[job]->dependents) {
+		skip(dependent);
+	}
+}
+
+void Job_Pool::execute(int worker, int job)
+{
+	// Lost to a failed dependency while it was queued
+	int pending = PENDING;
+	if (!m_jobs[job]->state.compare_exchange_strong(pending, RUNNING))
+		return;
+
+	bool ok = m_jobs[job]->fn();
+	m_jobs[job]->state = ok ? DONE : FAILED;
+	for (int dependent : m_jobs[job]->dependents) {
+		if (!ok) {
+			skip(dependent);
+		}
+		else if (--m_jobs[dependent]->remaining == 0) {
+			push(worker, dependent);
+		}
+	}
+	finish();
+}
+
+bool Job_Pool::run(int n_threads)
+{
+	n_threads = std::max(1, n_threads);
+	m_workers.clear();
+	for (int t = 0; t < n_threads; ++t) {
+		m_workers.emplace_back(new Worker());
+	}
+	m_queued = 0;
+	m_finished = 0;
+
+	int next_worker = 0;
+	for (int job = 0; job < (int)m_jobs.size(); ++job) {
+		m_jobs[job]->state = PENDING;
+		m_jobs[job]->remaining = m_jobs[job]->n_dependencies;
+		if (m_jobs[job]->n_dependencies == 0) {
+			push(next_worker++ % n_threads, job);
+		}
+	}
+
+	auto work = [&](int worker) {
+		for (;;) {
+			int job;
+			if (pop(worker, job)) {
+				execute(worker, job);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(m_idle_mutex);
+			m_wake.wait(lock, [&] { return m_queued > 0 || m_finished == (int)m_jobs.size(); });
+			if (m_finished == (int)m_jobs.size())
+				return;
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int t = 1; t < n_threads; ++t) {
+		threads.emplace_back(work, t);
+	}
+	work(0);
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	bool ok = true;
+	for (const std::unique_ptr<Job>& job : m_jobs) {
+		ok = ok && job->state == DONE;
+	}
+	return ok;
+}
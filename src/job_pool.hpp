@@ -0,0 +1,61 @@
+#pragma once
+
+// stdlib
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Work-stealing pool running a DAG of jobs. Every worker runs jobs from the back of its own
+// deque and steals from the front of the others' when it runs dry. A finished job pushes the
+// dependents it unblocked on its own worker's deque, dependents of a failed job are skipped.
+class Job_Pool
+{
+public:
+	enum State { PENDING, RUNNING, DONE, FAILED, SKIPPED };
+
+	// fn returns false on failure, the id is the index of the job
+	int add(std::function<bool()> fn);
+
+	// job only starts once on has finished successfully
+	void depend(int job, int on);
+
+	// Runs every job on n_threads workers, false if any failed or was skipped
+	bool run(int n_threads);
+
+	State state(int job) const { return (State)m_jobs[job]->state.load(); }
+
+private:
+	struct Job
+	{
+		std::function<bool()> fn;
+		std::vector<int> dependents;
+		int n_dependencies = 0;
+		std::atomic<int> remaining{ 0 };
+		std::atomic<int> state{ PENDING };
+	};
+
+	struct Worker
+	{
+		std::mutex mutex;
+		std::deque<int> jobs;
+	};
+
+	void push(int worker, int job);
+	bool pop(int worker, int& job);
+	void execute(int worker, int job);
+	void skip(int job);
+	void finish();
+
+	std::vector<std::unique_ptr<Job>> m_jobs;
+	std::vector<std::unique_ptr<Worker>> m_workers;
+
+	// Idle workers sleep until a job is queued or everything is finished
+	std::mutex m_idle_mutex;
+	std::condition_variable m_wake;
+	int m_queued;
+	int m_finished;
+};
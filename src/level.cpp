@@ -0,0 +1,371 @@
+// Header
+#include "level.hpp"
+
+// stdlib
+#include <string.h>
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace
+{
+	const char MAGIC[4] = { 'L', 'E', 'V', 'L' };
+
+	bool is_digit(uint8_t c) { return c >= '0' && c <= '9'; }
+	bool is_blank(uint8_t c) { return c == ' ' || c == '\t' || c == '\r'; }
+	uint64_t align8(uint64_t n) { return (n + 7) & ~(uint64_t)7; }
+
+	bool ends_with(const std::string& s, const char* suffix)
+	{
+		size_t n = strlen(suffix);
+		return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+	}
+}
+
+Level::Level() : m_rows(0), m_cols(0), m_n_free(0), m_obstacles(nullptr), m_neighbors(nullptr),
+	m_free_index(nullptr), m_free_cells(nullptr), m_tiles(nullptr), m_image(nullptr), m_size(0), m_bounce_table(nullptr) { }
+Level::~Level() { }
+
+bool Level::load(const std::string& path)
+{
+	if (ends_with(path, ".lvl"))
+		return load_binary(path);
+	return load_text(path);
+}
+
+bool Level::load_text(const std::string& path)
+{
+	Mapped_File file;
+	if (!file.open(path.c_str())) {
+		fprintf(stderr, "Failed to open level %s\n", path.c_str());
+		return false;
+	}
+
+	// Every token takes at least 5 bytes, which bounds the cell count before the dimensions are known
+	size_t capacity = file.size / 5 + 1;
+	std::vector<uint8_t> scratch(2 * capacity);
+	uint8_t* obstacles = scratch.data();
+	uint8_t* tiles = scratch.data() + capacity;
+
+	int rows = 0;
+	int cols = 0;
+	int col = 0;
+	size_t cells = 0;
+
+	auto end_row = [&]() {
+		if (col == 0)
+			return true;
+		if (rows == 0) {
+			cols = col;
+		}
+		else if (col != cols) {
+			fprintf(stderr, "Level %s: row %d has %d cells, expected %d\n", path.c_str(), rows, col, cols);
+			return false;
+		}
+		rows++;
+		col = 0;
+		return true;
+	};
+
+	const uint8_t* p = file.data;
+	const uint8_t* end = file.data + file.size;
+	while (p < end) {
+		if (is_blank(*p)) {
+			++p;
+			continue;
+		}
+		if (*p == '\n') {
+			if (!end_row())
+				return false;
+			++p;
+			continue;
+		}
+
+		if (end - p < 5 || !is_digit(p[0]) || !is_digit(p[1]) || (p[2] != '/' && p[2] != '\\') ||
+			!is_digit(p[3]) || !is_digit(p[4]) || (end - p > 5 && !is_blank(p[5]) && p[5] != '\n')) {
+			fprintf(stderr, "Level %s: malformed cell at row %d, column %d\n", path.c_str(), rows, col);
+			return false;
+		}
+
+		int tex_col = (p[0] - '0') * 10 + (p[1] - '0');
+		int tex_row = (p[3] - '0') * 10 + (p[4] - '0');
+		if (tex_col >= 8 || tex_row >= 16) {
+			fprintf(stderr, "Level %s: tile %d/%d at row %d, column %d is outside the atlas\n", path.c_str(), tex_col, tex_row, rows, col);
+			return false;
+		}
+
+		obstacles[cells] = p[2] == '/';
+		tiles[cells] = (uint8_t)(tex_row + 16 * tex_col);
+		cells++;
+		col++;
+		p += 5;
+	}
+	if (!end_row())
+		return false;
+
+	if (rows == 0) {
+		fprintf(stderr, "Level %s is empty\n", path.c_str());
+		return false;
+	}
+
+	return compile(rows, cols, obstacles, tiles);
+}
+
+bool Level::compile(int rows, int cols, const uint8_t* obstacles, const uint8_t* tiles)
+{
+	size_t cells = (size_t)rows * cols;
+	int n_free = 0;
+	for (size_t cell = 0; cell < cells; ++cell) {
+		n_free += obstacles[cell] == 0;
+	}
+
+	Level_Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.rows = rows;
+	header.cols = cols;
+	header.n_free = n_free;
+	header.obstacles_offset = align8(sizeof(Level_Header));
+	header.neighbors_offset = header.obstacles_offset + ((cells + 63) / 64) * 8;
+	header.free_index_offset = align8(header.neighbors_offset + (cells + 1) / 2);
+	header.free_cells_offset = align8(header.free_index_offset + cells * 4);
+	header.tiles_offset = align8(header.free_cells_offset + n_free * 4);
+	header.size = align8(header.tiles_offset + cells);
+
+	std::unique_ptr<uint64_t[]> data(new uint64_t[header.size / 8]());
+	uint8_t* image = (uint8_t*)data.get();
+	memcpy(image, &header, sizeof(header));
+
+	uint64_t* obstacle_bits = (uint64_t*)(image + header.obstacles_offset);
+	uint8_t* neighbors = image + header.neighbors_offset;
+	int32_t* free_index = (int32_t*)(image + header.free_index_offset);
+	int32_t* free_cells = (int32_t*)(image + header.free_cells_offset);
+	memcpy(image + header.tiles_offset, tiles, cells);
+
+	int next_free = 0;
+	for (int row = 0; row < rows; ++row) {
+		for (int col = 0; col < cols; ++col) {
+			size_t cell = (size_t)row * cols + col;
+			if (obstacles[cell]) {
+				obstacle_bits[cell >> 6] |= (uint64_t)1 << (cell & 63);
+				free_index[cell] = -1;
+			}
+			else {
+				free_index[cell] = next_free;
+				free_cells[next_free++] = (int32_t)cell;
+			}
+
+			// Outside the grid counts as blocked
+			uint8_t mask = 0;
+			if (row > 0 && !obstacles[cell - cols])			mask |= FREE_UP;
+			if (col > 0 && !obstacles[cell - 1])			mask |= FREE_LEFT;
+			if (row + 1 < rows && !obstacles[cell + cols])	mask |= FREE_DOWN;
+			if (col + 1 < cols && !obstacles[cell + 1])		mask |= FREE_RIGHT;
+			neighbors[cell >> 1] |= mask << ((cell & 1) << 2);
+		}
+	}
+
+	m_file.close();
+	m_data = std::move(data);
+	return attach(image, header.size, std::string());
+}
+
+const Level* Level::shared(const std::string& path)
+{
+	static std::mutex mutex;
+	static std::map<std::string, std::unique_ptr<Level>> levels;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	std::unique_ptr<Level>& level = levels[path];
+	if (level == nullptr) {
+		std::unique_ptr<Level> loaded(new Level());
+		if (!loaded->load(path)) {
+			levels.erase(path);
+			return nullptr;
+		}
+		level = std::move(loaded);
+	}
+	return level.get();
+}
+
+void Level::view(const Level& source)
+{
+	m_file.close();
+	m_data.reset();
+	m_bounces.clear();
+
+	m_image = source.m_image;
+	m_size = source.m_size;
+	m_rows = source.m_rows;
+	m_cols = source.m_cols;
+	m_n_free = source.m_n_free;
+	m_obstacles = source.m_obstacles;
+	m_neighbors = source.m_neighbors;
+	m_free_index = source.m_free_index;
+	m_free_cells = source.m_free_cells;
+	m_tiles = source.m_tiles;
+	m_bounce_table = source.m_bounce_table;
+}
+
+bool Level::load_binary(const std::string& path)
+{
+	if (!m_file.open(path.c_str())) {
+		fprintf(stderr, "Failed to open level %s\n", path.c_str());
+		return false;
+	}
+	m_data.reset();
+	return attach(m_file.data, m_file.size, path);
+}
+
+bool Level::attach(const uint8_t* image, size_t size, const std::string& path)
+{
+	Level_Header header;
+	if (size < sizeof(header)) {
+		fprintf(stderr, "Level %s is truncated\n", path.c_str());
+		return false;
+	}
+	memcpy(&header, image, sizeof(header));
+
+	uint64_t cells = (uint64_t)header.rows * header.cols;
+	if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION) {
+		fprintf(stderr, "Level %s is not a version %u compiled level\n", path.c_str(), VERSION);
+		return false;
+	}
+	if (cells == 0 || header.n_free > cells || header.size > size ||
+		header.obstacles_offset + (cells + 63) / 64 * 8 > header.size ||
+		header.neighbors_offset + (cells + 1) / 2 > header.size ||
+		header.free_index_offset + cells * 4 > header.size ||
+		header.free_cells_offset + (uint64_t)header.n_free * 4 > header.size ||
+		header.tiles_offset + cells > header.size ||
+		(header.obstacles_offset | header.free_index_offset | header.free_cells_offset) % 8 != 0) {
+		fprintf(stderr, "Level %s has an inconsistent header\n", path.c_str());
+		return false;
+	}
+
+	// The cell tables are indexed without bounds checks everywhere: free_index and free_cells have
+	// to be inverse of each other over the free cells, which are not obstacles, and the neighbor
+	// masks may only point at free cells of the grid
+	const uint64_t* obstacles = (const uint64_t*)(image + header.obstacles_offset);
+	const uint8_t* neighbors = image + header.neighbors_offset;
+	const int32_t* free_index = (const int32_t*)(image + header.free_index_offset);
+	const int32_t* free_cells = (const int32_t*)(image + header.free_cells_offset);
+	int rows = (int)header.rows;
+	int cols = (int)header.cols;
+	bool consistent = true;
+	for (uint32_t i = 0; i < header.n_free && consistent; ++i) {
+		int32_t cell = free_cells[i];
+		consistent = cell >= 0 && (uint64_t)cell < cells && free_index[cell] == (int32_t)i &&
+			!((obstacles[cell >> 6] >> (cell & 63)) & 1);
+	}
+	for (uint64_t cell = 0; cell < cells && consistent; ++cell) {
+		int32_t index = free_index[cell];
+		consistent = index == -1 || (index >= 0 && (uint32_t)index < header.n_free && (uint64_t)free_cells[index] == cell);
+
+		int row = (int)(cell / cols);
+		int col = (int)(cell % cols);
+		uint8_t free = (neighbors[cell >> 1] >> ((cell & 1) << 2)) & 0xF;
+		int d_row[4] = { -1, 0, 1, 0 };
+		int d_col[4] = { 0, -1, 0, 1 };
+		for (int d = 0; d < 4 && consistent; ++d) {
+			if (!((free >> d) & 1))
+				continue;
+			int r = row + d_row[d];
+			int c = col + d_col[d];
+			consistent = r >= 0 && r < rows && c >= 0 && c < cols && free_index[r * cols + c] >= 0;
+		}
+	}
+	if (!consistent) {
+		fprintf(stderr, "Level %s has inconsistent cell tables\n", path.c_str());
+		return false;
+	}
+
+	m_image = image;
+	m_size = header.size;
+	m_rows = header.rows;
+	m_cols = header.cols;
+	m_n_free = header.n_free;
+	m_obstacles = obstacles;
+	m_neighbors = neighbors;
+	m_free_index = free_index;
+	m_free_cells = free_cells;
+	m_tiles = image + header.tiles_offset;
+	build_bounces();
+	return true;
+}
+
+void Level::build_bounces()
+{
+	// Bounce outcomes only depend on the 4 bit free mask, solve the walk once per mask and direction
+	Bounce by_mask[16][4];
+	for (int mask = 0; mask < 16; ++mask) {
+		for (int start = 0; start < 4; ++start) {
+			// p[s][o], probability of ending on free direction o from blocked direction s
+			double p[4][4] = {};
+			for (int iteration = 0; iteration < 128; ++iteration) {
+				double next[4][4] = {};
+				for (int s = 0; s < 4; ++s) {
+					if (mask & (1 << s))
+						continue;
+					for (int turn = 1; turn <= 3; turn += 2) {
+						int t = (s + turn) & 3;
+						for (int o = 0; o < 4; ++o) {
+							next[s][o] += 0.5 * ((mask & (1 << t)) ? (double)(t == o) : p[t][o]);
+						}
+					}
+				}
+				memcpy(p, next, sizeof(p));
+			}
+
+			Bounce& bounce = by_mask[mask][start];
+			memset(&bounce, 0, sizeof(bounce));
+			double cumulative = 0.0;
+			for (int o = 0; o < 4; ++o) {
+				if ((mask & (1 << o)) == 0 || p[start][o] <= 0.0)
+					continue;
+				cumulative += p[start][o];
+				bounce.direction[bounce.n] = (uint8_t)o;
+				bounce.probability[bounce.n] = (float)p[start][o];
+				double scaled = cumulative * 4294967296.0;
+				bounce.threshold[bounce.n] = scaled >= 4294967295.0 ? 0xFFFFFFFFu : (uint32_t)scaled;
+				bounce.n++;
+			}
+		}
+	}
+
+	m_bounces.resize((size_t)m_rows * m_cols * 4);
+	for (int row = 0; row < m_rows; ++row) {
+		for (int col = 0; col < m_cols; ++col) {
+			const Bounce* bounces = by_mask[free_neighbors(row, col)];
+			std::copy(bounces, bounces + 4, &m_bounces[(row * m_cols + col) * 4]);
+		}
+	}
+	m_bounce_table = m_bounces.data();
+}
+
+uint64_t Level::hash() const
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < m_size; ++i) {
+		hash = (hash ^ m_image[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+bool Level::save(const std::string& path) const
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr) {
+		fprintf(stderr, "Failed to open %s for writing\n", path.c_str());
+		return false;
+	}
+	bool ok = fwrite(m_image, 1, m_size, file) == m_size;
+	ok = fclose(file) == 0 && ok;
+	if (!ok) {
+		fprintf(stderr, "Failed to write level %s\n", path.c_str());
+	}
+	return ok;
+}
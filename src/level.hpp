@@ -0,0 +1,125 @@
+#pragma once
+
+#include "mapped_file.hpp"
+
+// stdlib
+#include <string>
+#include <memory>
+#include <vector>
+
+// On-disk layout of a compiled level (.lvl), also the in-memory image of parsed text levels.
+// Little-endian, every section is 8-byte aligned and addressed by its offset from the start.
+struct Level_Header
+{
+	char magic[4];				// "LEVL"
+	uint32_t version;
+	uint32_t rows;
+	uint32_t cols;
+	uint32_t n_free;
+	uint32_t reserved;
+	uint64_t size;				// whole image in bytes
+	uint64_t obstacles_offset;	// uint64 bitboard, bit row * cols + col is set for obstacles
+	uint64_t neighbors_offset;	// 4-bit free neighbour masks, two cells per byte, low nibble first
+	uint64_t free_index_offset;	// int32 per cell, dense index of free cells, -1 for obstacles
+	uint64_t free_cells_offset;	// int32 per free cell, the cell it indexes
+	uint64_t tiles_offset;		// uint8 per cell, atlas tile tex_row + 16 * tex_col
+};
+
+// Where the bat goes when the cell in its direction is blocked. The original rule turns the
+// direction ccw or cw with even odds until it points to a free cell, an absorbing random walk
+// over the 4 directions whose outcome distribution only depends on the free neighbour mask.
+struct Bounce
+{
+	uint8_t n;				// outcomes, 0 if the cell is walled in
+	uint8_t direction[3];	// 0 up, 1 left, 2 down, 3 right (move action - 1)
+	float probability[3];
+	uint32_t threshold[3];	// cumulative probability * 2^32, the last outcome takes the rest
+};
+
+// Static layout of a level. Text levels are grids of "CC/RR" (obstacle) or "CC\RR" (free)
+// tokens, CC / RR being the atlas row / column of the cell sprite; compiled levels hold the
+// same data plus the derived per-cell metadata so they can be used straight from a mapping.
+class Level
+{
+public:
+	static const uint32_t VERSION = 1;
+
+	// Free neighbour bits, in the order of the move actions 1-4
+	enum Neighbor { FREE_UP = 1, FREE_LEFT = 2, FREE_DOWN = 4, FREE_RIGHT = 8 };
+
+	Level();
+	~Level();
+
+	// .lvl files are mapped as-is, anything else is parsed as text in a single pass and compiled in memory
+	bool load(const std::string& path);
+
+	// Level of path loaded once for the whole process and kept until exit, nullptr if it fails
+	// to load. Safe to call from any thread.
+	static const Level* shared(const std::string& path);
+
+	// Views the image and bounce table of source, which has to outlive this level
+	void view(const Level& source);
+
+	// Writes the compiled image
+	bool save(const std::string& path) const;
+
+	// FNV-1a of the compiled image, tells levels apart in caches and checkpoints
+	uint64_t hash() const;
+
+	bool is_obstacle(int row, int col) const
+	{
+		int cell = row * m_cols + col;
+		return (m_obstacles[cell >> 6] >> (cell & 63)) & 1;
+	}
+
+	uint8_t free_neighbors(int row, int col) const
+	{
+		int cell = row * m_cols + col;
+		return (m_neighbors[cell >> 1] >> ((cell & 1) << 2)) & 0xF;
+	}
+
+	int free_index(int row, int col) const { return m_free_index[row * m_cols + col]; }
+	uint8_t tile(int row, int col) const { return m_tiles[row * m_cols + col]; }
+
+	// direction is the blocked one the bat came in with
+	const Bounce& bounce(int row, int col, int direction) const { return m_bounce_table[(row * m_cols + col) * 4 + direction]; }
+
+	// Picks a bounce outcome from a uniform 32 bit draw
+	static int sample(const Bounce& bounce, uint32_t draw)
+	{
+		int i = 0;
+		while (i + 1 < bounce.n && draw >= bounce.threshold[i]) {
+			++i;
+		}
+		return bounce.direction[i];
+	}
+
+	int m_rows;
+	int m_cols;
+	int m_n_free;
+
+	// Views into the compiled image
+	const uint64_t* m_obstacles;
+	const uint8_t* m_neighbors;
+	const int32_t* m_free_index;
+	const int32_t* m_free_cells;
+	const uint8_t* m_tiles;
+
+private:
+	bool load_text(const std::string& path);
+	bool load_binary(const std::string& path);
+	bool compile(int rows, int cols, const uint8_t* obstacles, const uint8_t* tiles);
+	bool attach(const uint8_t* image, size_t size, const std::string& path);
+	void build_bounces();
+
+	const uint8_t* m_image;
+	size_t m_size;
+
+	// Owns the image of text levels, compiled levels stay in the mapping
+	std::unique_ptr<uint64_t[]> m_data;
+	Mapped_File m_file;
+
+	// 4 per cell, derived from the neighbour masks on load, or the one of the viewed level
+	std::vector<Bounce> m_bounces;
+	const Bounce* m_bounce_table;
+};
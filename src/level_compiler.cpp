@@ -0,0 +1,25 @@
+// internal
+#include "level.hpp"
+
+// stlib
+#include <iostream>
+
+// Compiles text levels into the binary .lvl format loaded by Level::load
+// ./level_compiler level_0.txt level_0.lvl [level_1.txt level_1.lvl ...]
+int main(int argc, char* argv[])
+{
+	if (argc < 3 || argc % 2 == 0) {
+		std::cout << "[ ERROR ] incorrect args\n";
+		std::cout << "[ EXAMPLE ./level_compiler data/levels/level_0.txt data/levels/level_0.lvl \n";
+		return EXIT_FAILURE;
+	}
+
+	for (int i = 1; i < argc; i += 2) {
+		Level level;
+		if (!level.load(argv[i]) || !level.save(argv[i + 1])) {
+			return EXIT_FAILURE;
+		}
+		std::cout << argv[i + 1] << ": " << level.m_rows << "x" << level.m_cols << ", " << level.m_n_free << " free cells\n";
+	}
+	return EXIT_SUCCESS;
+}
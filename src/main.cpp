@@ -3,12 +3,19 @@
 #include "grid_world.hpp"
 #include "deepQ.hpp"
 #include "tabq.hpp"
+#include "trace.hpp"
+#include "policy_eval.hpp"
+#include "batch_eval.hpp"
+#include "scheduler.hpp"
+#include "distill.hpp"
 
 #define GL3W_IMPLEMENTATION
 #include <gl3w.h>
 
 // stlib
 #include <iostream>
+#include <chrono>
+#include <thread>
 
 // libtorch
 #include <torch/torch.h>
@@ -16,20 +23,141 @@
 // Global 
 Grid_World 	g_world;
 
+// "a,b,c" -> { a, b, c }
+std::vector<std::string> split(const std::string& list)
+{
+	std::vector<std::string> items;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		items.push_back(item);
+	}
+	return items;
+}
+
 // Entry point
 int main(int argc, char* argv[])
 {
-	if (argc < 3) {
+	if (argc < 4) {
 		std::cout << "[ ERROR ] incorrect args\n";
 		std::cout << "[ EXAMPLE ./game play level_0.txt bat 1 2 3 4 \n";
+		std::cout << "[ EXAMPLE ./game evaluate all all --episodes 10 \n";
 		return EXIT_FAILURE;
 	}
 
 	std::string flag = std::string(argv[1]);
 	std::string filename_level = argv[2];
 	std::string enemy_flag = std::string(argv[3]);
-	std::vector<int> hero_pos = { atoi(argv[4]), atoi(argv[5]) };
-	std::vector<int> enemy_pos = { atoi(argv[6]), atoi(argv[7]) };
+
+	// Start cells are optional for evaluate, which sweeps them, and schedule
+	std::vector<int> hero_pos = { 0, 0 };
+	std::vector<int> enemy_pos = { 0, 0 };
+	bool has_pos = false;
+	int first_option = 4;
+	if (argc >= 8 && argv[4][0] != '-') {
+		has_pos = true;
+		hero_pos = { atoi(argv[4]), atoi(argv[5]) };
+		enemy_pos = { atoi(argv[6]), atoi(argv[7]) };
+		first_option = 8;
+	}
+
+	// Optional trailing flags
+	bool reachable = false;
+	bool resume = false;
+	std::string trace_path;
+	int trace_sample = 16;
+	std::string algo = "tabq";
+	std::string policy_path;
+	double gamma = 0.99;
+	int horizon = 500;
+	int threads = (int)std::thread::hardware_concurrency();
+	int episodes = 10;
+	int samples = 64;
+	int steps = 500;
+	std::string out_path;
+	bool header = false;
+	Q_Store::Format q_format = Q_Store::FLOAT32;
+	Q_Table::Backend q_backend = Q_Table::DENSE;
+	double symmetry_tolerance = 0.0;
+	for (int i = first_option; i < argc; ++i) {
+		std::string option = argv[i];
+		if (option == "--reachable") {
+			reachable = true;
+		}
+		else if (option == "--resume") {
+			resume = true;
+		}
+		else if (option == "--trace" && i + 1 < argc) {
+			trace_path = argv[++i];
+		}
+		else if (option == "--trace-sample" && i + 1 < argc) {
+			trace_sample = atoi(argv[++i]);
+		}
+		else if (option == "--algo" && i + 1 < argc) {
+			algo = argv[++i];
+		}
+		else if (option == "--policy" && i + 1 < argc) {
+			policy_path = argv[++i];
+		}
+		else if (option == "--gamma" && i + 1 < argc) {
+			gamma = atof(argv[++i]);
+		}
+		else if (option == "--horizon" && i + 1 < argc) {
+			horizon = atoi(argv[++i]);
+		}
+		else if (option == "--threads" && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+		}
+		else if (option == "--episodes" && i + 1 < argc) {
+			episodes = atoi(argv[++i]);
+		}
+		else if (option == "--samples" && i + 1 < argc) {
+			samples = atoi(argv[++i]);
+		}
+		else if (option == "--steps" && i + 1 < argc) {
+			steps = atoi(argv[++i]);
+		}
+		else if (option == "--out" && i + 1 < argc) {
+			out_path = argv[++i];
+		}
+		else if (option == "--header") {
+			header = true;
+		}
+		else if (option == "--quantize" && i + 1 < argc && Q_Store::parse(argv[i + 1], q_format)) {
+			++i;
+		}
+		else if (option == "--sparse") {
+			q_backend = Q_Table::SPARSE;
+		}
+		else if (option == "--symmetry-tolerance" && i + 1 < argc) {
+			symmetry_tolerance = atof(argv[++i]);
+		}
+		else if (option == "--no-symmetry") {
+			symmetry_tolerance = -1.0;
+		}
+		else {
+			std::cout << "[ ERROR ] unknown option " << option << "\n";
+			std::cout << "[ '--reachable' to only learn the cells and states reachable from the start cells (tabq), export those states (tabq, dqn)\n";
+			std::cout << "[ '--quantize fp16|int8' to store the Q-table in reduced precision (tabq)\n";
+			std::cout << "[ '--sparse' to only store the visited states of the Q-table, in float32, for large levels (tabq)\n";
+			std::cout << "[ '--symmetry-tolerance 0.05' share of transitions a level symmetry may break and still fold the Q-table, '--no-symmetry' (tabq)\n";
+			std::cout << "[ '--resume' to continue from the last checkpoint (tabq, dqn)\n";
+			std::cout << "[ '--trace out.json' to write a Chrome trace, '--trace-sample N' to keep 1 step in N\n";
+			std::cout << "[ '--algo tabq|dqn', '--policy path' hero policy to evaluate, dqn defaults to its model.pt (eval-exact)\n";
+			std::cout << "[ '--gamma 0.99', '--horizon 500' steps, 0 for the infinite sum, '--threads N' (eval-exact)\n";
+			std::cout << "[ '--episodes 10', '--samples 64' start pairs, 0 for all, '--steps 500', '--out scores.csv' (evaluate)\n";
+			std::cout << "[ '--header' to also generate the table header compiled into the next build (distill)\n";
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!trace_path.empty()) {
+#ifdef ENABLE_TRACE
+		TRACE_BEGIN(trace_path.c_str(), trace_sample < 1 ? 1 : trace_sample);
+#else
+		std::cout << "[ WARNING ] built without ENABLE_TRACE, --trace is ignored\n";
+#endif
+	}
 
 	int enemy_type = -1;
 	if (enemy_flag.compare(std::string("bat")) == 0){
@@ -41,11 +169,15 @@ int main(int argc, char* argv[])
 	else if (enemy_flag.compare(std::string("knight")) == 0){
 		enemy_type = 2;
 	}
-	if (enemy_type == -1) {
+	else if (enemy_flag.compare(std::string("pathfinder")) == 0){
+		enemy_type = 3;
+	}
+	if (enemy_type == -1 && !(flag == "evaluate" && enemy_flag == "all") && flag != "schedule") {
 		std::cout << "[ ERROR ] incorrect enemy type\n";
 		std::cout << "[ 'bat' for basic \n";
 		std::cout << "[ 'skeleton' for intermediate \n";
 		std::cout << "[ 'knight' for advanced \n";
+		std::cout << "[ 'pathfinder' for a shortest path chaser \n";
 		return EXIT_FAILURE;
 	}
 
@@ -81,25 +213,139 @@ int main(int argc, char* argv[])
 
 	else if (flag ==  "tabq") {
 		if (g_world.init(filename_level, flag, enemy_type, hero_pos, enemy_pos)) {
-			TabQ* q = new TabQ(&g_world);
-			q->train();
+			TabQ* q = new TabQ(&g_world, reachable, q_format, q_backend, symmetry_tolerance);
+			if (!q->train(resume))
+				return EXIT_FAILURE;
 		}
 	}
 
 	else if (flag == "dqn") {
 		if (g_world.init(filename_level, flag, enemy_type, hero_pos, enemy_pos)) {
-			deepQ* q = new deepQ(&g_world);
-			q->train();
+			deepQ* q = new deepQ(&g_world, DQN_Model::directory(enemy_type, g_world.m_level_name), reachable);
+			if (!q->train(resume))
+				return EXIT_FAILURE;
 		}
 	}
 
+	else if (flag == "eval-exact") {
+		if (!g_world.init(filename_level, algo, enemy_type, hero_pos, enemy_pos))
+			return EXIT_FAILURE;
+
+		// Without --policy a dqn hero is its model when there is one
+		DQN_Model model;
+		Policy hero;
+		if (policy_path.empty() && algo == "dqn" && model.load(DQN_Model::directory(enemy_type, g_world.m_level_name) + "model.pt")) {
+			policy_path = DQN_Model::directory(enemy_type, g_world.m_level_name) + "model.pt";
+			model.attach(hero, g_world);
+		}
+		else {
+			if (policy_path.empty()) {
+				policy_path = policies_path(enemy_flag + "-" + g_world.m_level_name + "-" + algo + "_policy.txt");
+			}
+			hero.init(&g_world.m_state_index);
+			if (!hero.load_txt(policy_path)) {
+				std::cout << "[ ERROR ] failed to load " << policy_path << "\n";
+				return EXIT_FAILURE;
+			}
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		Policy_Eval eval;
+		if (!eval.build(g_world, hero))
+			return EXIT_FAILURE;
+		int sweeps = eval.solve(gamma, horizon, threads);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::cout << "[ EVAL ] " << policy_path << ": " << eval.size() << " states, " << eval.m_leaked << " leaked transitions, "
+			<< sweeps << " sweeps in " << seconds << " s\n";
+		// reset() draws the enemy action among the 4 moves
+		std::vector<ivec2> starts = g_world.start_cells();
+		double mean = 0.0;
+		for (int action = 1; action <= 4; ++action) {
+			int64_t state[5] = { starts[0].x, starts[0].y, starts[1].x, starts[1].y, action };
+			double value = eval.value(state);
+			std::cout << "[ START ] enemy action " << action << ": " << value << "\n";
+			mean += value / 4;
+		}
+		std::cout << "[ RETURN ] " << mean << " (gamma " << gamma << ", horizon " << horizon << ")\n";
+		g_world.destroy();
+	}
+
+	else if (flag == "distill") {
+		if (!g_world.init(filename_level, algo, enemy_type, hero_pos, enemy_pos))
+			return EXIT_FAILURE;
+
+		Distiller distiller;
+		if (!distiller.build(g_world, enemy_type, algo)) {
+			std::cout << "[ ERROR ] no trained " << algo << " policy for " << enemy_flag << " on " << filename_level << "\n";
+			return EXIT_FAILURE;
+		}
+		std::string table_path = policies_path(distiller.m_name + "_policy.pk4");
+		if (!distiller.save_table(table_path))
+			return EXIT_FAILURE;
+		std::cout << "[ DISTILL ] " << distiller.m_source << " -> " << table_path << ": " << distiller.m_n_exported << " states in "
+			<< (distiller.m_policy.m_actions.size() + 1) / 2 << " bytes\n";
+		if (header) {
+			if (!distiller.save_header(generated_path))
+				return EXIT_FAILURE;
+			std::cout << "[ DISTILL ] " << generated_path << distiller.m_name << ".hpp, rebuild to compile it in\n";
+		}
+		g_world.destroy();
+	}
+
+	else if (flag == "evaluate") {
+		std::vector<std::string> levels = { filename_level };
+		if (filename_level == "all") {
+			levels = { "level_0.txt", "level_1.txt", "level_2.txt" };
+		}
+		std::vector<int> enemy_types = { enemy_type };
+		if (enemy_type == -1) {
+			enemy_types = { 0, 1, 2, 3 };
+		}
+
+		Batch_Eval eval;
+		if (!eval.run(levels, enemy_types, algo, episodes, samples, steps, threads, out_path))
+			return EXIT_FAILURE;
+		eval.print();
+	}
+
+	else if (flag == "schedule") {
+		std::vector<std::string> levels = split(filename_level);
+		if (filename_level == "all") {
+			levels = { "level_0.txt", "level_1.txt", "level_2.txt" };
+		}
+		std::vector<int> enemy_types;
+		for (const std::string& name : split(enemy_flag == "all" ? std::string("bat,skeleton,knight,pathfinder") : enemy_flag)) {
+			int type = name == "bat" ? 0 : name == "skeleton" ? 1 : name == "knight" ? 2 : name == "pathfinder" ? 3 : -1;
+			if (type == -1) {
+				std::cout << "[ ERROR ] incorrect enemy type " << name << "\n";
+				return EXIT_FAILURE;
+			}
+			enemy_types.push_back(type);
+		}
+
+		Scheduler scheduler(has_pos ? hero_pos : std::vector<int>(), has_pos ? enemy_pos : std::vector<int>());
+		scheduler.add(levels, enemy_types, split(algo));
+		bool ok = scheduler.run(threads);
+		scheduler.print();
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
 	else {
 		std::cout << "[ ERROR ] incorrect flag\n";
 		std::cout << "[ 'play' to render and play game\n";
+		std::cout << "[ 'play-dqn' to play against the enemy of the dqn model, or its exported policy\n";
 		std::cout << "[ 'tabq' to NOT render and train with tabq\n";
 		std::cout << "[ 'dqn' to NOT render and train with dqn\n";
+		std::cout << "[ 'eval-exact' to solve the expected return of a trained policy\n";
+		std::cout << "[ 'evaluate' to play trained policies from many start cells, level / enemy can be 'all'\n";
+		std::cout << "[ 'distill' to pack a trained '--algo' policy into a 4-bit table the enemies play\n";
+		std::cout << "[ 'schedule' to train comma separated levels x enemies x '--algo tabq,dqn' concurrently, or 'all'\n";
 
 		return EXIT_FAILURE;
 	}
+
+	TRACE_END();
 	return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,147 @@
+// Header
+#include "mapped_file.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+Mapped_File::Mapped_File() : data(nullptr), size(0), m_writable(false)
+{
+#ifdef _WIN32
+	m_file = INVALID_HANDLE_VALUE;
+	m_mapping = nullptr;
+#endif
+}
+
+Mapped_File::~Mapped_File()
+{
+	close();
+}
+
+bool Mapped_File::open(const char* path)
+{
+	close();
+#ifdef _WIN32
+	m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(m_file, &file_size) || file_size.QuadPart == 0) {
+		close();
+		return false;
+	}
+	size = (size_t)file_size.QuadPart;
+
+	m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (m_mapping == nullptr) {
+		close();
+		return false;
+	}
+	data = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+	size = (size_t)st.st_size;
+
+	void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	data = mapped == MAP_FAILED ? nullptr : (const uint8_t*)mapped;
+#endif
+	if (data == nullptr) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool Mapped_File::open_writable(const char* path, size_t new_size)
+{
+	close();
+	if (new_size == 0)
+		return false;
+	size = new_size;
+#ifdef _WIN32
+	m_file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_file == INVALID_HANDLE_VALUE) {
+		size = 0;
+		return false;
+	}
+
+	LARGE_INTEGER file_size;
+	file_size.QuadPart = (LONGLONG)new_size;
+	m_mapping = nullptr;
+	if (SetFilePointerEx(m_file, file_size, NULL, FILE_BEGIN) && SetEndOfFile(m_file)) {
+		m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READWRITE, 0, 0, NULL);
+	}
+	if (m_mapping == nullptr) {
+		close();
+		return false;
+	}
+	data = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, 0);
+#else
+	int fd = ::open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		size = 0;
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || ((size_t)st.st_size != new_size && ftruncate(fd, (off_t)new_size) != 0)) {
+		::close(fd);
+		size = 0;
+		return false;
+	}
+
+	void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	data = mapped == MAP_FAILED ? nullptr : (const uint8_t*)mapped;
+#endif
+	if (data == nullptr) {
+		close();
+		return false;
+	}
+	m_writable = true;
+	return true;
+}
+
+bool Mapped_File::sync()
+{
+	if (!m_writable)
+		return true;
+#ifdef _WIN32
+	return FlushViewOfFile(data, 0) && FlushFileBuffers(m_file);
+#else
+	return msync((void*)data, size, MS_SYNC) == 0;
+#endif
+}
+
+void Mapped_File::close()
+{
+#ifdef _WIN32
+	if (data != nullptr) UnmapViewOfFile(data);
+	if (m_mapping != nullptr) CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+	m_mapping = nullptr;
+	m_file = INVALID_HANDLE_VALUE;
+#else
+	if (data != nullptr) munmap((void*)data, size);
+#endif
+	data = nullptr;
+	size = 0;
+	m_writable = false;
+}
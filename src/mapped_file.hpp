@@ -0,0 +1,38 @@
+#pragma once
+
+// stdlib
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory mapping of a whole file, read-only unless opened writable
+struct Mapped_File
+{
+	Mapped_File();
+	~Mapped_File();
+
+	const uint8_t* data;
+	size_t size;
+
+	bool open(const char* path); // maps the file, empty files are rejected
+	void close(); // unmaps, safe to call twice
+
+	// Maps path shared and read-write, creating it or resizing it to size bytes first when it
+	// differs, grown bytes read as zero
+	bool open_writable(const char* path, size_t size);
+
+	// Blocks until the dirty pages are on disk, false on I/O errors
+	bool sync();
+
+	uint8_t* writable_data() const { return m_writable ? (uint8_t*)data : nullptr; }
+
+private:
+	Mapped_File(const Mapped_File&);
+	Mapped_File& operator=(const Mapped_File&);
+
+	bool m_writable;
+
+#ifdef _WIN32
+	void* m_file;
+	void* m_mapping;
+#endif
+};
@@ -0,0 +1,313 @@
+// Header
+#include "metrics.hpp"
+
+// stdlib
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+
+namespace
+{
+	enum Kind { COUNTER, GAUGE, HISTOGRAM };
+
+	struct Entry
+	{
+		std::string name;
+		Kind kind;
+		int slot;
+	};
+
+	struct Histogram_Shard
+	{
+		std::atomic<uint64_t> buckets[Metrics::HISTOGRAM_BUCKETS];
+		std::atomic<uint64_t> sum;
+	};
+
+	// Written by its thread only, summed by the aggregator
+	struct Shard
+	{
+		std::atomic<int64_t> counters[Metrics::MAX_METRICS];
+		Histogram_Shard histograms[Metrics::MAX_HISTOGRAMS];
+	};
+
+	// Registration, shard list and output
+	std::mutex g_mutex;
+	std::vector<Entry> g_entries;
+	std::vector<Shard*> g_shards; // never freed, counts outlive their thread
+	int g_n_counters = 0;
+	int g_n_gauges = 0;
+	int g_n_histograms = 0;
+	std::atomic<double> g_gauges[Metrics::MAX_METRICS];
+
+	// Aggregator, shared by nested start() / stop() pairs
+	std::mutex g_session_mutex;
+	int g_sessions = 0;
+	std::mutex g_thread_mutex;
+	std::condition_variable g_wake;
+	std::thread g_thread;
+	bool g_running = false;
+	FILE* g_csv = nullptr;
+	std::string g_prefix;
+
+	Shard* thread_shard()
+	{
+		thread_local Shard* shard = nullptr;
+		if (shard == nullptr) {
+			shard = new Shard();
+			std::lock_guard<std::mutex> lock(g_mutex);
+			g_shards.push_back(shard);
+		}
+		return shard;
+	}
+
+	int highest_bit(uint64_t value)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		return 63 - __builtin_clzll(value);
+#else
+		int bit = 0;
+		while (value >>= 1) {
+			++bit;
+		}
+		return bit;
+#endif
+	}
+
+	int add_entry(const char* name, Kind kind, int& n_slots, int max_slots)
+	{
+		std::lock_guard<std::mutex> lock(g_mutex);
+		for (const Entry& entry : g_entries) {
+			if (entry.name == name)
+				return entry.kind == kind ? entry.slot : -1;
+		}
+		if (n_slots == max_slots) {
+			fprintf(stderr, "Too many metrics, %s is dropped\n", name);
+			return -1;
+		}
+		g_entries.push_back({ name, kind, n_slots });
+		return n_slots++;
+	}
+
+	// Value at quantile q from summed bucket counts, as the bucket upper bound
+	uint64_t quantile(const std::vector<uint64_t>& buckets, uint64_t count, double q)
+	{
+		uint64_t rank = (uint64_t)(q * count);
+		if (rank >= count) {
+			rank = count - 1;
+		}
+		uint64_t seen = 0;
+		for (int b = 0; b < Metrics::HISTOGRAM_BUCKETS; ++b) {
+			seen += buckets[b];
+			if (seen > rank)
+				return Metrics::bucket_upper(b);
+		}
+		return 0;
+	}
+
+	// Sums the shards, appends the CSV rows and rewrites the Prometheus file
+	void flush()
+	{
+		std::lock_guard<std::mutex> lock(g_mutex);
+		// Unix time so appended runs stay ordered
+		double seconds = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+		std::string prom;
+		char line[256];
+		std::vector<uint64_t> buckets(Metrics::HISTOGRAM_BUCKETS);
+		for (const Entry& entry : g_entries) {
+			const char* name = entry.name.c_str();
+			if (entry.kind == COUNTER) {
+				int64_t value = 0;
+				for (Shard* shard : g_shards) {
+					value += shard->counters[entry.slot].load(std::memory_order_relaxed);
+				}
+				fprintf(g_csv, "%.3f,%s,%lld\n", seconds, name, (long long)value);
+				snprintf(line, sizeof(line), "# TYPE %s counter\n%s %lld\n", name, name, (long long)value);
+				prom += line;
+			}
+			else if (entry.kind == GAUGE) {
+				double value = g_gauges[entry.slot].load(std::memory_order_relaxed);
+				fprintf(g_csv, "%.3f,%s,%.6g\n", seconds, name, value);
+				snprintf(line, sizeof(line), "# TYPE %s gauge\n%s %.6g\n", name, name, value);
+				prom += line;
+			}
+			else {
+				uint64_t count = 0;
+				uint64_t sum = 0;
+				for (int b = 0; b < Metrics::HISTOGRAM_BUCKETS; ++b) {
+					buckets[b] = 0;
+					for (Shard* shard : g_shards) {
+						buckets[b] += shard->histograms[entry.slot].buckets[b].load(std::memory_order_relaxed);
+					}
+					count += buckets[b];
+				}
+				for (Shard* shard : g_shards) {
+					sum += shard->histograms[entry.slot].sum.load(std::memory_order_relaxed);
+				}
+
+				fprintf(g_csv, "%.3f,%s_count,%llu\n", seconds, name, (unsigned long long)count);
+				if (count > 0) {
+					fprintf(g_csv, "%.3f,%s_mean,%.6g\n", seconds, name, (double)sum / count);
+					fprintf(g_csv, "%.3f,%s_p50,%llu\n", seconds, name, (unsigned long long)quantile(buckets, count, 0.5));
+					fprintf(g_csv, "%.3f,%s_p90,%llu\n", seconds, name, (unsigned long long)quantile(buckets, count, 0.9));
+					fprintf(g_csv, "%.3f,%s_p99,%llu\n", seconds, name, (unsigned long long)quantile(buckets, count, 0.99));
+					fprintf(g_csv, "%.3f,%s_max,%llu\n", seconds, name, (unsigned long long)quantile(buckets, count, 1.0));
+				}
+
+				// Cumulative buckets, empty ones are left out
+				snprintf(line, sizeof(line), "# TYPE %s histogram\n", name);
+				prom += line;
+				uint64_t cumulative = 0;
+				for (int b = 0; b < Metrics::HISTOGRAM_BUCKETS; ++b) {
+					if (buckets[b] == 0)
+						continue;
+					cumulative += buckets[b];
+					snprintf(line, sizeof(line), "%s_bucket{le=\"%llu\"} %llu\n", name, (unsigned long long)Metrics::bucket_upper(b), (unsigned long long)cumulative);
+					prom += line;
+				}
+				snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %llu\n%s_count %llu\n",
+					name, (unsigned long long)count, name, (unsigned long long)sum, name, (unsigned long long)count);
+				prom += line;
+			}
+		}
+		fflush(g_csv);
+
+		// Readers never see a partial file
+		std::string path = g_prefix + "metrics.prom";
+		std::string temp = path + ".tmp";
+		FILE* file = fopen(temp.c_str(), "wb");
+		if (file == nullptr)
+			return;
+		bool ok = fwrite(prom.data(), 1, prom.size(), file) == prom.size();
+		ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+		remove(path.c_str());
+#endif
+		if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+			fprintf(stderr, "Failed to write %s\n", path.c_str());
+		}
+	}
+
+	void aggregate(double period)
+	{
+		std::unique_lock<std::mutex> lock(g_thread_mutex);
+		while (g_running) {
+			g_wake.wait_for(lock, std::chrono::duration<double>(period));
+			if (g_running) {
+				flush();
+			}
+		}
+	}
+}
+
+int Metrics::counter(const char* name)
+{
+	return add_entry(name, COUNTER, g_n_counters, MAX_METRICS);
+}
+
+int Metrics::gauge(const char* name)
+{
+	return add_entry(name, GAUGE, g_n_gauges, MAX_METRICS);
+}
+
+int Metrics::histogram(const char* name)
+{
+	return add_entry(name, HISTOGRAM, g_n_histograms, MAX_HISTOGRAMS);
+}
+
+void Metrics::add(int counter, int64_t value)
+{
+	if (counter < 0)
+		return;
+	std::atomic<int64_t>& slot = thread_shard()->counters[counter];
+	slot.store(slot.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void Metrics::set(int gauge, double value)
+{
+	if (gauge < 0)
+		return;
+	g_gauges[gauge].store(value, std::memory_order_relaxed);
+}
+
+void Metrics::record(int histogram, uint64_t value)
+{
+	if (histogram < 0)
+		return;
+	Histogram_Shard& shard = thread_shard()->histograms[histogram];
+	std::atomic<uint64_t>& count = shard.buckets[bucket(value)];
+	count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	shard.sum.store(shard.sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+int Metrics::bucket(uint64_t value)
+{
+	if (value < 16)
+		return (int)value;
+	int exponent = highest_bit(value);
+	int bucket = 16 + (exponent - 4) * 8 + (int)((value >> (exponent - 3)) & 7);
+	return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+uint64_t Metrics::bucket_upper(int bucket)
+{
+	if (bucket < 16)
+		return bucket;
+	int exponent = 4 + (bucket - 16) / 8;
+	uint64_t lower = (uint64_t)(8 + (bucket - 16) % 8) << (exponent - 3);
+	return lower + ((uint64_t)1 << (exponent - 3)) - 1;
+}
+
+bool Metrics::start(const std::string& prefix, double period)
+{
+	std::lock_guard<std::mutex> session(g_session_mutex);
+	if (g_sessions > 0) {
+		g_sessions++;
+		return true;
+	}
+
+	std::string path = prefix + "metrics.csv";
+	FILE* csv = fopen(path.c_str(), "ab");
+	if (csv == nullptr) {
+		fprintf(stderr, "Failed to open %s for writing\n", path.c_str());
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(g_mutex);
+		g_csv = csv;
+		g_prefix = prefix;
+	}
+	fseek(csv, 0, SEEK_END);
+	if (ftell(csv) == 0) {
+		fprintf(csv, "seconds,name,value\n");
+	}
+
+	g_running = true;
+	g_thread = std::thread(aggregate, period);
+	g_sessions = 1;
+	return true;
+}
+
+void Metrics::stop()
+{
+	std::lock_guard<std::mutex> session(g_session_mutex);
+	if (g_sessions == 0 || --g_sessions > 0)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(g_thread_mutex);
+		g_running = false;
+	}
+	g_wake.notify_one();
+	g_thread.join();
+
+	flush();
+	std::lock_guard<std::mutex> lock(g_mutex);
+	fclose(g_csv);
+	g_csv = nullptr;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+// stdlib
+#include <stdint.h>
+#include <string>
+
+// Training metrics: counters, gauges and log-linear latency histograms. Updates are relaxed
+// atomic writes into a per-thread shard, a background thread sums the shards every period and
+// appends them to <prefix>metrics.csv ("unix seconds,name,value" rows) and rewrites
+// <prefix>metrics.prom in the Prometheus text format.
+//
+//	static const int STEPS = Metrics::counter("steps");
+//	Metrics::add(STEPS);
+class Metrics
+{
+public:
+	// Room for the metrics of every job of a full scheduled matrix, each under its own prefix
+	static const int MAX_METRICS = 256;
+	static const int MAX_HISTOGRAMS = 64;
+
+	// Histogram buckets are exact below 16 and keep 3 significant bits above, up to 2^48
+	static const int HISTOGRAM_BUCKETS = 16 + 44 * 8;
+
+	// Registration is idempotent by name, ids are -1 once the limits are reached and
+	// updating them is a no-op
+	static int counter(const char* name);
+	static int gauge(const char* name);
+	static int histogram(const char* name);
+
+	static void add(int counter, int64_t value = 1);
+	static void set(int gauge, double value);
+	static void record(int histogram, uint64_t value);
+
+	// Starts the aggregator, period in seconds. Nested calls (trainers run by the scheduler)
+	// join the running aggregator and its prefix.
+	static bool start(const std::string& prefix, double period = 1.0);
+
+	// Stops the aggregator after a last flush once every start() is matched
+	static void stop();
+
+	static int bucket(uint64_t value);
+	static uint64_t bucket_upper(int bucket);
+};
@@ -0,0 +1,352 @@
+// Header
+#include "policy.hpp"
+#include "mapped_file.hpp"
+
+// stdlib
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+namespace
+{
+	// Parses an unsigned integer, false if there is no digit
+	bool parse_int(const uint8_t*& p, const uint8_t* end, int& value)
+	{
+		const uint8_t* start = p;
+		value = 0;
+		while (p < end && *p >= '0' && *p <= '9') {
+			value = value * 10 + (*p++ - '0');
+		}
+		return p != start;
+	}
+
+	char* write_int(char* p, int value)
+	{
+		char digits[12];
+		int n = 0;
+		do {
+			digits[n++] = (char)('0' + value % 10);
+			value /= 10;
+		} while (value != 0);
+		while (n > 0) {
+			*p++ = digits[--n];
+		}
+		return p;
+	}
+
+	// Policy lines of the (state index, action) pairs next(index, action) yields until it returns false
+	template<typename Next>
+	bool write_txt(const std::string& path, const State_Index& index, uint32_t symmetry, Next next)
+	{
+		FILE* file = fopen(path.c_str(), "wb");
+		if (file == nullptr) {
+			fprintf(stderr, "Failed to open %s for writing\n", path.c_str());
+			return false;
+		}
+
+		// Lines are at most 5 * 11 + 6 bytes, flushed in large blocks
+		std::vector<char> buffer(1 << 16);
+		char* p = buffer.data();
+		if (symmetry != 1) {
+			p += snprintf(p, 32, "#symmetry %u\n", symmetry);
+		}
+		bool ok = true;
+		int64_t state[5];
+		int64_t i;
+		int action;
+		while (next(i, action)) {
+			index.state(i, state);
+			for (int k = 0; k < 5; ++k) {
+				p = write_int(p, (int)state[k]);
+				*p++ = k < 4 ? ',' : '=';
+			}
+			p = write_int(p, action);
+			*p++ = '\n';
+
+			if (p - buffer.data() > (ptrdiff_t)buffer.size() - 64) {
+				ok = ok && fwrite(buffer.data(), 1, p - buffer.data(), file) == (size_t)(p - buffer.data());
+				p = buffer.data();
+			}
+		}
+		ok = ok && fwrite(buffer.data(), 1, p - buffer.data(), file) == (size_t)(p - buffer.data());
+		ok = fclose(file) == 0 && ok;
+		if (!ok) {
+			fprintf(stderr, "Failed to write policy %s\n", path.c_str());
+		}
+		return ok;
+	}
+}
+
+const uint8_t Policy::UNSET;
+
+Policy::Policy() : m_index(nullptr), m_packed(nullptr), m_source() { }
+
+int Policy::fill(int64_t index, int hero_row, int hero_col, int enemy_row, int enemy_col, int enemy_action) const
+{
+	int64_t state[5] = { hero_row, hero_col, enemy_row, enemy_col, enemy_action };
+	int action = m_fill(state);
+	if (m_index->is_exported(index)) {
+		m_actions[index] = (uint8_t)action;
+	}
+	return action;
+}
+
+int64_t Policy::grid_state(int hero_row, int hero_col, int enemy_row, int enemy_col, int enemy_action) const
+{
+	int rows = m_index->m_rows;
+	int cols = m_index->m_cols;
+	if ((unsigned)hero_row >= (unsigned)rows || (unsigned)hero_col >= (unsigned)cols ||
+		(unsigned)enemy_row >= (unsigned)rows || (unsigned)enemy_col >= (unsigned)cols ||
+		(unsigned)enemy_action >= (unsigned)m_index->m_n_actions)
+		return -1;
+	return ((int64_t)(hero_row * cols + hero_col) * rows * cols + enemy_row * cols + enemy_col) * m_index->m_n_actions + enemy_action;
+}
+
+int Policy::outside(int hero_row, int hero_col, int enemy_row, int enemy_col, int enemy_action) const
+{
+	int64_t state = grid_state(hero_row, hero_col, enemy_row, enemy_col, enemy_action);
+	std::vector<std::pair<int64_t, uint8_t>>::const_iterator it =
+		std::lower_bound(m_outside.begin(), m_outside.end(), std::make_pair(state, (uint8_t)0));
+	return it != m_outside.end() && it->first == state ? it->second : 0;
+}
+
+void Policy::init(const State_Index* index)
+{
+	m_index = index;
+	m_actions.assign(index->size(), UNSET);
+	m_outside.clear();
+	m_packed = nullptr;
+	m_source = Source_Stamp();
+	m_symmetry.build(*index, 1);
+}
+
+bool Policy::load_txt(const std::string& path)
+{
+	Mapped_File file;
+	if (!file.open(path.c_str())) {
+		fprintf(stderr, "Failed to open policy %s\n", path.c_str());
+		return false;
+	}
+
+	const char separators[5] = { ',', ',', ',', ',', '=' };
+	const uint8_t* p = file.data;
+	const uint8_t* end = file.data + file.size;
+	int line = 1;
+	const char header[] = "#symmetry ";
+	int mask = 1;
+	if ((size_t)(end - p) > sizeof(header) - 1 && memcmp(p, header, sizeof(header) - 1) == 0) {
+		p += sizeof(header) - 1;
+		if (!parse_int(p, end, mask)) {
+			fprintf(stderr, "Policy %s: malformed line %d\n", path.c_str(), line);
+			return false;
+		}
+	}
+	set_symmetry((uint32_t)mask);
+	if (m_symmetry.m_mask != (uint32_t)(mask | 1)) {
+		fprintf(stderr, "Policy %s: symmetry %d does not fit this level\n", path.c_str(), mask);
+		return false;
+	}
+
+	std::vector<int64_t> loaded;
+	m_outside.clear();
+	while (p < end) {
+		if (*p == '\n' || *p == '\r') {
+			line += *p == '\n';
+			++p;
+			continue;
+		}
+
+		int v[6];
+		for (int i = 0; i < 6; ++i) {
+			if (!parse_int(p, end, v[i]) || (i < 5 && (p == end || *p++ != separators[i]))) {
+				fprintf(stderr, "Policy %s: malformed line %d\n", path.c_str(), line);
+				return false;
+			}
+		}
+
+		if (v[4] < m_index->m_n_actions && v[5] < UNSET) {
+			int hero = m_index->cell(v[0], v[1]);
+			int enemy = m_index->cell(v[2], v[3]);
+			if (hero != m_index->m_overflow && enemy != m_index->m_overflow) {
+				int64_t index = ((int64_t)hero * m_index->m_n_cells + enemy) * m_index->m_n_actions + v[4];
+				m_actions[index] = (uint8_t)v[5];
+				if (m_symmetry.order() > 1) {
+					loaded.push_back(index);
+				}
+			}
+			else {
+				int64_t state = grid_state(v[0], v[1], v[2], v[3], v[4]);
+				if (state >= 0) {
+					m_outside.emplace_back(state, (uint8_t)v[5]);
+				}
+			}
+		}
+	}
+	// The last line of a state wins, as with the table
+	std::stable_sort(m_outside.begin(), m_outside.end(),
+		[](const std::pair<int64_t, uint8_t>& a, const std::pair<int64_t, uint8_t>& b) { return a.first < b.first; });
+	size_t n = 0;
+	for (size_t i = 0; i < m_outside.size(); ++i) {
+		if (n > 0 && m_outside[n - 1].first == m_outside[i].first)
+			m_outside[n - 1] = m_outside[i];
+		else
+			m_outside[n++] = m_outside[i];
+	}
+	m_outside.resize(n);
+
+	// Images of a state act as the state turned, listed states win over filled ones
+	for (int64_t index : loaded) {
+		for (int k = 1; k < m_symmetry.order(); ++k) {
+			int t = m_symmetry.transform(k);
+			int64_t image = m_symmetry.image(t, index);
+			if (m_actions[image] == UNSET) {
+				m_actions[image] = (uint8_t)m_symmetry.action(t, m_actions[index]);
+			}
+		}
+	}
+	return true;
+}
+
+bool Policy::save_txt(const std::string& path) const
+{
+	int64_t n = (int64_t)m_actions.size();
+	int64_t next = 0;
+	bool symmetric = m_symmetry.order() > 1;
+	return write_txt(path, *m_index, symmetric ? m_symmetry.m_mask : 1, [this, n, symmetric, &next](int64_t& i, int& action) {
+		int t;
+		while (next < n && (m_actions[next] == UNSET || !m_index->is_exported(next) || (symmetric && m_symmetry.canonical(next, t) != next))) {
+			next++;
+		}
+		if (next == n)
+			return false;
+		i = next++;
+		action = m_actions[i];
+		return true;
+	});
+}
+
+bool Policy::save_txt(const std::string& path, const State_Index& index, const std::vector<std::pair<int64_t, uint8_t>>& actions, uint32_t symmetry)
+{
+	size_t next = 0;
+	return write_txt(path, index, symmetry, [&](int64_t& i, int& action) {
+		while (next < actions.size() && !index.is_exported(actions[next].first)) {
+			next++;
+		}
+		if (next == actions.size())
+			return false;
+		i = actions[next].first;
+		action = actions[next++].second;
+		return true;
+	});
+}
+
+std::vector<uint8_t> Policy::pack() const
+{
+	std::vector<uint8_t> packed((m_actions.size() + 1) / 2, 0);
+	for (size_t i = 0; i < m_actions.size(); ++i) {
+		uint8_t action = m_actions[i] == UNSET ? 0 : m_actions[i];
+		packed[i >> 1] |= (uint8_t)(action << ((i & 1) * 4));
+	}
+	return packed;
+}
+
+uint64_t Policy::hash() const
+{
+	if (m_fill)
+		return 0;
+	const uint8_t* actions = m_packed != nullptr ? m_packed : m_actions.data();
+	size_t n = m_packed != nullptr ? (size_t)(m_index->size() + 1) / 2 : m_actions.size();
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < n; ++i) {
+		hash = (hash ^ actions[i]) * 1099511628211ull;
+	}
+	for (const std::pair<int64_t, uint8_t>& line : m_outside) {
+		for (int byte = 0; byte < 8; ++byte) {
+			hash = (hash ^ (uint8_t)(line.first >> (byte * 8))) * 1099511628211ull;
+		}
+		hash = (hash ^ line.second) * 1099511628211ull;
+	}
+	return hash;
+}
+
+bool Policy::save_packed(const std::string& path, uint64_t level_hash, const Source_Stamp& source) const
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr) {
+		fprintf(stderr, "Failed to open %s for writing\n", path.c_str());
+		return false;
+	}
+
+	Packed_Policy_Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "PK4P", 4);
+	header.version = 3;
+	header.level_hash = level_hash;
+	header.n_states = m_actions.size();
+	header.source = source;
+	header.n_outside = m_outside.size();
+	std::vector<uint8_t> packed = pack();
+	std::vector<int64_t> outside_states;
+	std::vector<uint8_t> outside_actions;
+	for (const std::pair<int64_t, uint8_t>& line : m_outside) {
+		outside_states.push_back(line.first);
+		outside_actions.push_back(line.second);
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && fwrite(packed.data(), 1, packed.size(), file) == packed.size();
+	ok = ok && fwrite(outside_states.data(), sizeof(int64_t), outside_states.size(), file) == outside_states.size();
+	ok = ok && fwrite(outside_actions.data(), 1, outside_actions.size(), file) == outside_actions.size();
+	ok = fclose(file) == 0 && ok;
+	if (!ok) {
+		fprintf(stderr, "Failed to write policy %s\n", path.c_str());
+	}
+	return ok;
+}
+
+bool Policy::load_packed(const std::string& path, uint64_t level_hash)
+{
+	Mapped_File file;
+	if (!file.open(path.c_str()))
+		return false;
+
+	const Packed_Policy_Header* header = (const Packed_Policy_Header*)file.data;
+	size_t n_states = m_actions.size();
+	if (file.size < sizeof(Packed_Policy_Header) || memcmp(header->magic, "PK4P", 4) != 0 || header->version != 3 ||
+		header->level_hash != level_hash || header->n_states != n_states ||
+		file.size != sizeof(Packed_Policy_Header) + (n_states + 1) / 2 + header->n_outside * (sizeof(int64_t) + 1)) {
+		fprintf(stderr, "%s is not a packed policy of this level\n", path.c_str());
+		return false;
+	}
+
+	const uint8_t* packed = file.data + sizeof(Packed_Policy_Header);
+	for (size_t i = 0; i < n_states; ++i) {
+		m_actions[i] = (packed[i >> 1] >> ((i & 1) * 4)) & 0xF;
+	}
+	// The grid states follow the odd sized table unaligned
+	const uint8_t* outside_states = packed + (n_states + 1) / 2;
+	const uint8_t* outside_actions = outside_states + header->n_outside * sizeof(int64_t);
+	m_outside.resize(header->n_outside);
+	for (size_t i = 0; i < m_outside.size(); ++i) {
+		memcpy(&m_outside[i].first, outside_states + i * sizeof(int64_t), sizeof(int64_t));
+		m_outside[i].second = outside_actions[i];
+	}
+	m_source = header->source;
+	return true;
+}
+
+bool Policy::view_compiled(const State_Index* index, const std::string& name, uint64_t level_hash)
+{
+	const Compiled_Policy* table = compiled(name);
+	if (table == nullptr || table->level_hash != level_hash || table->n_states != index->size())
+		return false;
+
+	m_index = index;
+	m_actions.clear();
+	m_outside.clear();
+	for (int64_t i = 0; i < table->n_outside; ++i) {
+		m_outside.emplace_back(table->outside_states[i], table->outside_actions[i]);
+	}
+	m_packed = table->actions;
+	m_source = table->source;
+	return true;
+}
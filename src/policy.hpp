@@ -0,0 +1,135 @@
+#pragma once
+
+#include "state_index.hpp"
+#include "symmetry.hpp"
+
+// stdlib
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Policy a table was distilled from, a table whose source changed since is stale
+struct Source_Stamp
+{
+	uint64_t hash;			// Policy::hash() of the text policy, FNV-1a of the dqn model file
+	int64_t time;			// modification time of the source file
+};
+
+// Header of the 4-bit packed policy files (.pk4) written by distill. It is followed by the actions
+// of every indexed state, two states per byte, low nibble first, unset states as 0, then by the
+// grid states of the lines outside the index as int64 and their actions as bytes.
+struct Packed_Policy_Header
+{
+	char magic[4];			// "PK4P"
+	uint32_t version;
+	uint64_t level_hash;	// Level::hash() of the level the policy was trained on
+	uint64_t n_states;		// State_Index::size() over all free cells and 13 enemy actions
+	Source_Stamp source;
+	uint64_t n_outside;		// lines outside the index, by ascending grid state
+};
+
+// Packed table compiled into the binary from the headers distill generates in src/generated
+struct Compiled_Policy
+{
+	const char* name;		// "<enemy>-<level>-<algo>", as in the text policy file names
+	uint64_t level_hash;
+	Source_Stamp source;
+	int64_t n_states;
+	const uint8_t* actions;
+	int64_t n_outside;
+	const int64_t* outside_states; // nullptr without lines outside the index
+	const uint8_t* outside_actions;
+};
+
+// Greedy action per indexed state, read from / written to the policies/*_policy.txt files.
+// Every line is "hero_row,hero_col,enemy_row,enemy_col,enemy_action=action". Policies of
+// symmetric levels start with a "#symmetry <mask>" line of the Symmetry transforms kept and only
+// list canonical states, the loader fills in their images.
+class Policy
+{
+public:
+	static const uint8_t UNSET = 0xFF;
+
+	Policy();
+
+	// Sizes the table for index, which has to outlive the policy, all states start unset
+	void init(const State_Index* index);
+
+	// Lines for states outside the index on a grid cell (walls, cells cut off from the starts) are
+	// kept aside and still answer lookups there, as the full grid table of the first policy files
+	// did. The transposed enemy lookups land on such cells. Others are skipped.
+	bool load_txt(const std::string& path);
+
+	// Writes one line per exported state that is set, canonical states only under a symmetry
+	bool save_txt(const std::string& path) const;
+
+	// Lines of the exported states of actions alone, for tables too large to size a policy for.
+	// Under a symmetry mask other than 1 they have to be canonical states.
+	static bool save_txt(const std::string& path, const State_Index& index, const std::vector<std::pair<int64_t, uint8_t>>& actions, uint32_t symmetry = 1);
+
+	// Transforms of mask the policy is invariant under, after init()
+	void set_symmetry(uint32_t mask) { m_symmetry.build(*m_index, mask); }
+
+	// The table two states per byte, low nibble first, unset states as 0
+	std::vector<uint8_t> pack() const;
+
+	// FNV-1a of the actions, 0 for policies with a fill function whose table is only a cache
+	uint64_t hash() const;
+
+	// .pk4 files, rejected unless they were packed over the same level and index. source is the
+	// stamp of the policy the table was distilled from, m_source after loading.
+	bool load_packed(const std::string& path, uint64_t level_hash);
+	bool save_packed(const std::string& path, uint64_t level_hash, const Source_Stamp& source) const;
+
+	// Reads actions straight from the compiled in table of name, false if there is none for this
+	// level and index. The policy is read-only then.
+	bool view_compiled(const State_Index* index, const std::string& name, uint64_t level_hash);
+
+	// Compiled in table of name, nullptr if there is none
+	static const Compiled_Policy* compiled(const std::string& name);
+
+	void set(int64_t index, int action) { m_actions[index] = (uint8_t)action; }
+
+	// Loaded lines outside the index by ascending grid state, carried over into distilled tables
+	const std::vector<std::pair<int64_t, uint8_t>>& outside_lines() const { return m_outside; }
+	void set_outside_lines(const std::vector<std::pair<int64_t, uint8_t>>& lines) { m_outside = lines; }
+
+	// Unset states get the action fn picks for their 5 extract_state() components the first time
+	// they are asked for, turning the table into a cache. Overflow states are never cached. Filling
+	// writes the table, a policy with a fill function is not to be shared between threads.
+	void set_fill(std::function<int(const int64_t* state)> fn) { m_fill = std::move(fn); }
+
+	// Unset states act as action 0 without a fill function or a loaded line outside the index
+	int action(int hero_row, int hero_col, int enemy_row, int enemy_col, int enemy_action) const
+	{
+		int64_t index = m_index->index(hero_row, hero_col, enemy_row, enemy_col, enemy_action);
+		// Packed tables hold 0 for the overflow states the lines outside the index fall on
+		if (!m_outside.empty() && !m_index->is_exported(index))
+			return outside(hero_row, hero_col, enemy_row, enemy_col, enemy_action);
+		if (m_packed != nullptr)
+			return (m_packed[index >> 1] >> ((index & 1) * 4)) & 0xF;
+		uint8_t action = m_actions[index];
+		if (action == UNSET)
+			return m_fill ? fill(index, hero_row, hero_col, enemy_row, enemy_col, enemy_action) : 0;
+		return action;
+	}
+
+	const State_Index* m_index;
+	mutable std::vector<uint8_t> m_actions;
+	const uint8_t* m_packed; // compiled in table, m_actions is empty then
+	Source_Stamp m_source; // of a packed or compiled table, zero otherwise
+
+private:
+	int fill(int64_t index, int hero_row, int hero_col, int enemy_row, int enemy_col, int enemy_action) const;
+
+	// Loaded action of a state outside the index, 0 if there is none
+	int outside(int hero_row, int hero_col, int enemy_row, int enemy_col, int enemy_action) const;
+
+	// Grid numbering of a state over every cell of the level box, -1 off the box
+	int64_t grid_state(int hero_row, int hero_col, int enemy_row, int enemy_col, int enemy_action) const;
+
+	Symmetry m_symmetry;
+	std::function<int(const int64_t* state)> m_fill;
+	std::vector<std::pair<int64_t, uint8_t>> m_outside; // load_txt lines outside the index by ascending grid_state()
+};
@@ -0,0 +1,178 @@
+// Header
+#include "policy_eval.hpp"
+
+// stdlib
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+#include <thread>
+
+namespace
+{
+	// Reusable barrier for the sweep threads
+	class Barrier
+	{
+	public:
+		Barrier(int n) : m_n(n), m_waiting(0), m_generation(0) { }
+
+		void wait()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			uint64_t generation = m_generation;
+			if (++m_waiting == m_n) {
+				m_waiting = 0;
+				m_generation++;
+				m_wake.notify_all();
+			}
+			else {
+				m_wake.wait(lock, [&] { return generation != m_generation; });
+			}
+		}
+
+	private:
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		int m_n;
+		int m_waiting;
+		uint64_t m_generation;
+	};
+}
+
+Policy_Eval::Policy_Eval() : m_leaked(0), m_index(nullptr) { }
+
+bool Policy_Eval::build(Grid_World& world, const Policy& hero)
+{
+	m_index = &world.m_state_index;
+	m_row.assign(m_index->size(), -1);
+	m_states.clear();
+	m_starts.clear();
+	m_rewards.clear();
+	m_first.assign(1, 0);
+	m_next.clear();
+	m_probability.clear();
+	m_leaked = 0;
+
+	// Rows are numbered in discovery order, so the row list doubles as the BFS queue
+	auto row_of = [&](int64_t index) {
+		if (m_row[index] < 0) {
+			m_row[index] = (int32_t)m_states.size();
+			m_states.push_back(index);
+		}
+		return m_row[index];
+	};
+
+	std::vector<ivec2> starts = world.start_cells();
+	for (int action = 1; action <= 4; ++action) {
+		int64_t index = m_index->index(starts[0].x, starts[0].y, starts[1].x, starts[1].y, action);
+		if (!m_index->is_exported(index)) {
+			fprintf(stderr, "Start cells are not free\n");
+			return false;
+		}
+		m_starts.push_back(row_of(index));
+	}
+
+	int64_t state[5];
+	for (size_t row = 0; row < m_states.size(); ++row) {
+		m_index->state(m_states[row], state);
+		int action = hero.action((int)state[0], (int)state[1], (int)state[2], (int)state[3], (int)state[4]);
+
+		// Outcome 0 first, the other bounce outcomes only if the bat bounced
+		double reward = 0.0;
+		int n_outcomes = 1;
+		for (int outcome = 0; outcome < n_outcomes; ++outcome) {
+			world.force_bounce(outcome);
+			world.set_state(state);
+			world.m_points = 0;
+			world.update(action);
+
+			float probability = 1.f;
+			const Bounce* bounce = world.last_bounce();
+			if (bounce != nullptr && bounce->n > 1) {
+				n_outcomes = bounce->n;
+				probability = bounce->probability[outcome];
+			}
+			reward += probability * world.m_points;
+
+			int64_t next = m_index->index(world.extract_state());
+			if (!m_index->is_exported(next)) {
+				m_leaked++;
+				continue;
+			}
+			m_next.push_back(row_of(next));
+			m_probability.push_back(probability);
+		}
+		m_rewards.push_back((float)reward);
+		m_first.push_back((int64_t)m_next.size());
+	}
+	world.force_bounce(-1);
+	return true;
+}
+
+int Policy_Eval::solve(double gamma, int horizon, int n_threads, double tolerance)
+{
+	int64_t n = size();
+	n_threads = std::max(1, std::min<int>(n_threads, (int)std::max<int64_t>(1, n / 4096)));
+	int max_sweeps = horizon > 0 ? horizon : 1000000;
+
+	std::vector<double> buffers[2] = { std::vector<double>(n, 0.0), std::vector<double>(n, 0.0) };
+	std::vector<double> deltas[2] = { std::vector<double>(n_threads), std::vector<double>(n_threads) };
+	int sweeps = 0;
+	Barrier barrier(n_threads);
+
+	// Sweep k reads buffer k % 2 and writes the other one. Deltas are double buffered too, a
+	// thread can only overwrite its slot once every thread is past the check that reads it.
+	auto run = [&](int thread) {
+		int64_t begin = n * thread / n_threads;
+		int64_t end = n * (thread + 1) / n_threads;
+		for (int sweep = 0; sweep < max_sweeps; ++sweep) {
+			const double* values = buffers[sweep & 1].data();
+			double* next_values = buffers[(sweep + 1) & 1].data();
+			double delta = 0.0;
+			for (int64_t row = begin; row < end; ++row) {
+				double expected = 0.0;
+				for (int64_t t = m_first[row]; t < m_first[row + 1]; ++t) {
+					expected += m_probability[t] * values[m_next[t]];
+				}
+				double value = m_rewards[row] + gamma * expected;
+				delta = std::max(delta, std::fabs(value - values[row]));
+				next_values[row] = value;
+			}
+			deltas[sweep & 1][thread] = delta;
+			barrier.wait();
+
+			bool done = sweep + 1 == max_sweeps;
+			if (horizon == 0) {
+				double max_delta = *std::max_element(deltas[sweep & 1].begin(), deltas[sweep & 1].end());
+				done = done || max_delta <= tolerance;
+			}
+			if (done) {
+				if (thread == 0) {
+					sweeps = sweep + 1;
+				}
+				return;
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int t = 1; t < n_threads; ++t) {
+		threads.emplace_back(run, t);
+	}
+	run(0);
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	m_values.swap(buffers[sweeps & 1]);
+	return sweeps;
+}
+
+double Policy_Eval::value(const int64_t* state) const
+{
+	int64_t index = m_index->index((int)state[0], (int)state[1], (int)state[2], (int)state[3], (int)state[4]);
+	if (!m_index->is_exported(index) || m_row[index] < 0 || m_values.empty())
+		return std::numeric_limits<double>::quiet_NaN();
+	return m_values[m_row[index]];
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "grid_world.hpp"
+#include "policy.hpp"
+
+// stdlib
+#include <vector>
+
+// Exact evaluation of a hero policy. The Markov chain the policy induces on a headless world is
+// enumerated once from the reset() states, then its expected discounted returns are solved with
+// Jacobi sweeps over the sparse transition rows, split across threads. Only the bat's bounces
+// are random, every other transition has a single successor.
+class Policy_Eval
+{
+public:
+	Policy_Eval();
+
+	// Steps world from every state reachable from its reset() states with the hero following
+	// hero. The world is left in an arbitrary state.
+	bool build(Grid_World& world, const Policy& hero);
+
+	// Expected return of the next horizon steps of every state, or of the infinite discounted
+	// sum when horizon is 0, iterated until no value moves by more than tolerance. Returns the
+	// number of sweeps.
+	int solve(double gamma, int horizon, int n_threads, double tolerance = 1e-6);
+
+	int64_t size() const { return (int64_t)m_rewards.size(); }
+
+	// Value of an extract_state(), NaN if it was not reached
+	double value(const int64_t* state) const;
+
+	// States reset() draws from, with even odds
+	std::vector<int32_t> m_starts;
+
+	// Transitions that left the indexed cells (a hero shoved into a wall), they end the chain
+	int64_t m_leaked;
+
+	std::vector<double> m_values;
+
+private:
+	const State_Index* m_index;
+	std::vector<int32_t> m_row; // per index state, -1 if not reached
+	std::vector<int64_t> m_states; // per row, index state
+
+	// Sparse rows, expected reward and successors
+	std::vector<float> m_rewards;
+	std::vector<int64_t> m_first;
+	std::vector<int32_t> m_next;
+	std::vector<float> m_probability;
+};
@@ -0,0 +1,262 @@
+// Header
+#include "q_store.hpp"
+
+// stdlib
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define Q_STORE_SSE2
+#endif
+
+namespace
+{
+	const int INT8_MAX_Q = 127;
+	const int INT8_SCALE_BYTE = 14;
+
+	// Headroom of a grown int8 scale, so a value creeping up does not requantize its row on every update
+	const float SCALE_HEADROOM = 1.25f;
+
+	uint32_t float_bits(float f)
+	{
+		uint32_t x;
+		memcpy(&x, &f, 4);
+		return x;
+	}
+
+	float bits_float(uint32_t x)
+	{
+		float f;
+		memcpy(&f, &x, 4);
+		return f;
+	}
+
+	// Exponent and mantissa shifted into place, then rebased by 2^112, which also gets subnormal
+	// halves right. Infinities and NaNs are never stored.
+	float half_to_float(uint16_t h)
+	{
+		float f = bits_float((uint32_t)(h & 0x7fff) << 13) * bits_float(0x77800000);
+		return bits_float(float_bits(f) | ((uint32_t)(h & 0x8000) << 16));
+	}
+
+	// noise in [0, 2^13) is added below the kept mantissa bits: 0 truncates, 0x1fff rounds away
+	// from zero, uniform noise rounds stochastically. Out of range values clamp to the largest half.
+	uint16_t float_to_half(float f, uint32_t noise)
+	{
+		uint32_t x = float_bits(f);
+		uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+		x &= 0x7fffffff;
+		if (x >= 0x47800000)
+			return sign | 0x7bff;
+
+		// Below 2^-14 halves are multiples of 2^-24
+		if (x < 0x38800000)
+			return sign | (uint16_t)(bits_float(x) * 16777216.f + noise * (1.f / 8192.f));
+
+		uint32_t h = ((x + noise) >> 13) - (112 << 10);
+		return sign | (uint16_t)(h > 0x7bff ? 0x7bff : h);
+	}
+
+	uint16_t* half_row(uint8_t* data, int64_t row)
+	{
+		return (uint16_t*)(data + (size_t)row * Q_Store::LANES * sizeof(uint16_t));
+	}
+
+	int8_t* int8_row(uint8_t* data, int64_t row)
+	{
+		return (int8_t*)(data + (size_t)row * Q_Store::LANES);
+	}
+
+	float int8_scale(const int8_t* row)
+	{
+		uint16_t h;
+		memcpy(&h, row + INT8_SCALE_BYTE, 2);
+		return half_to_float(h);
+	}
+}
+
+bool Q_Store::parse(const std::string& name, Format& format)
+{
+	for (int f = FLOAT32; f <= INT8; ++f) {
+		if (name == Q_Store::name((Format)f)) {
+			format = (Format)f;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char* Q_Store::name(Format format)
+{
+	const char* names[3] = { "float32", "fp16", "int8" };
+	return names[format];
+}
+
+size_t Q_Store::bytes(Format format, int64_t rows, int cols)
+{
+	switch (format) {
+	case FP16:
+		return (size_t)rows * LANES * sizeof(uint16_t);
+	case INT8:
+		return (size_t)rows * LANES;
+	default:
+		return (size_t)rows * cols * sizeof(float);
+	}
+}
+
+Q_Store::Q_Store() :
+	m_format(FLOAT32),
+	m_data(nullptr),
+	m_rows(0),
+	m_cols(0),
+	m_noise(0x9e3779b9u)
+{
+}
+
+void Q_Store::view(Format format, uint8_t* data, int64_t rows, int cols)
+{
+	m_format = format;
+	m_data = data;
+	m_rows = rows;
+	m_cols = cols;
+}
+
+uint32_t Q_Store::noise()
+{
+	m_noise ^= m_noise << 13;
+	m_noise ^= m_noise >> 17;
+	m_noise ^= m_noise << 5;
+	return m_noise;
+}
+
+void Q_Store::load_row(int64_t row, float* out) const
+{
+	if (m_format == FLOAT32) {
+		memcpy(out, m_data + (size_t)row * m_cols * sizeof(float), m_cols * sizeof(float));
+		return;
+	}
+
+	if (m_format == FP16) {
+		const uint16_t* h = half_row(m_data, row);
+#ifdef Q_STORE_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i sign_mask = _mm_set1_epi32(0x8000);
+		const __m128i value_mask = _mm_set1_epi32(0x7fff);
+		const __m128 rebase = _mm_castsi128_ps(_mm_set1_epi32(0x77800000));
+		for (int i = 0; i < LANES; i += 8) {
+			__m128i halves = _mm_loadu_si128((const __m128i*)(h + i));
+			__m128i words[2] = { _mm_unpacklo_epi16(halves, zero), _mm_unpackhi_epi16(halves, zero) };
+			for (int k = 0; k < 2; ++k) {
+				__m128i sign = _mm_slli_epi32(_mm_and_si128(words[k], sign_mask), 16);
+				__m128i value = _mm_slli_epi32(_mm_and_si128(words[k], value_mask), 13);
+				__m128 f = _mm_mul_ps(_mm_castsi128_ps(value), rebase);
+				_mm_storeu_ps(out + i + 4 * k, _mm_or_ps(f, _mm_castsi128_ps(sign)));
+			}
+		}
+#else
+		for (int i = 0; i < m_cols; ++i) {
+			out[i] = half_to_float(h[i]);
+		}
+#endif
+		return;
+	}
+
+	const int8_t* q = int8_row(m_data, row);
+	float scale = int8_scale(q);
+#ifdef Q_STORE_SSE2
+	// Sign extension by unpacking a value with itself and shifting arithmetically
+	__m128i bytes = _mm_loadu_si128((const __m128i*)q);
+	__m128i low = _mm_srai_epi16(_mm_unpacklo_epi8(bytes, bytes), 8);
+	__m128i high = _mm_srai_epi16(_mm_unpackhi_epi8(bytes, bytes), 8);
+	__m128i words[4] = {
+		_mm_srai_epi32(_mm_unpacklo_epi16(low, low), 16),
+		_mm_srai_epi32(_mm_unpackhi_epi16(low, low), 16),
+		_mm_srai_epi32(_mm_unpacklo_epi16(high, high), 16),
+		_mm_srai_epi32(_mm_unpackhi_epi16(high, high), 16)
+	};
+	__m128 s = _mm_set1_ps(scale);
+	for (int k = 0; k < 4; ++k) {
+		_mm_storeu_ps(out + 4 * k, _mm_mul_ps(_mm_cvtepi32_ps(words[k]), s));
+	}
+#else
+	for (int i = 0; i < m_cols; ++i) {
+		out[i] = q[i] * scale;
+	}
+#endif
+}
+
+float Q_Store::load(int64_t row, int col) const
+{
+	switch (m_format) {
+	case FP16:
+		return half_to_float(half_row(m_data, row)[col]);
+	case INT8: {
+		const int8_t* q = int8_row(m_data, row);
+		return q[col] * int8_scale(q);
+	}
+	default:
+		return ((const float*)m_data)[(size_t)row * m_cols + col];
+	}
+}
+
+void Q_Store::store(int64_t row, int col, float value)
+{
+	if (m_format == FLOAT32) {
+		((float*)m_data)[(size_t)row * m_cols + col] = value;
+		return;
+	}
+
+	if (m_format == FP16) {
+		half_row(m_data, row)[col] = float_to_half(value, noise() >> 19);
+		return;
+	}
+
+	int8_t* q = int8_row(m_data, row);
+	float scale = int8_scale(q);
+	float magnitude = fabsf(value);
+	if (magnitude > INT8_MAX_Q * scale) {
+		// Grow the scale and requantize the rest of the row to it
+		uint16_t h = float_to_half(magnitude * SCALE_HEADROOM / INT8_MAX_Q, 0x1fff);
+		float grown = half_to_float(h);
+		for (int i = 0; i < m_cols; ++i) {
+			float x = q[i] * scale / grown;
+			q[i] = (int8_t)floorf(x + (noise() >> 8) * (1.f / 16777216.f));
+		}
+		memcpy(q + INT8_SCALE_BYTE, &h, 2);
+		scale = grown;
+	}
+
+	float x = scale > 0.f ? value / scale : 0.f;
+	x = floorf(x + (noise() >> 8) * (1.f / 16777216.f));
+	q[col] = (int8_t)(x < -INT8_MAX_Q ? -INT8_MAX_Q : (x > INT8_MAX_Q ? INT8_MAX_Q : x));
+}
+
+void Q_Store::store_row(int64_t row, const float* values)
+{
+	if (m_format == INT8) {
+		int8_t* q = int8_row(m_data, row);
+		float largest = 0.f;
+		for (int i = 0; i < m_cols; ++i) {
+			largest = fmaxf(largest, fabsf(values[i]));
+		}
+		uint16_t h = float_to_half(largest / INT8_MAX_Q, 0x1fff);
+		memset(q, 0, LANES);
+		memcpy(q + INT8_SCALE_BYTE, &h, 2);
+	}
+	for (int i = 0; i < m_cols; ++i) {
+		store(row, i, values[i]);
+	}
+}
+
+void Q_Store::fill_uniform(float low, float high, std::mt19937& rng)
+{
+	std::uniform_real_distribution<float> uniform(low, high);
+	float values[LANES];
+	for (int64_t row = 0; row < m_rows; ++row) {
+		for (int i = 0; i < m_cols; ++i) {
+			values[i] = uniform(rng);
+		}
+		store_row(row, values);
+	}
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+// stdlib
+#include <random>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+// Rows of Q-values over caller owned memory, in float32 or in a reduced precision format:
+// - FLOAT32 rows are cols floats, the layout TabQ always had
+// - FP16 rows are 16 halves, padded from cols
+// - INT8 rows are 16 bytes, cols signed values times a per row scale kept as a half in the last
+//   two bytes, four rows to a cache line
+// Reduced precision writes round stochastically, so updates smaller than one step still move the
+// stored value by the right amount on average.
+class Q_Store
+{
+public:
+	enum Format { FLOAT32, FP16, INT8 };
+
+	// Floats load_row() writes, the row is padded to it
+	static const int LANES = 16;
+
+	static bool parse(const std::string& name, Format& format);
+	static const char* name(Format format);
+	static size_t bytes(Format format, int64_t rows, int cols);
+
+	Q_Store();
+
+	// data holds bytes(format, rows, cols) bytes and has to outlive the store, cols <= 14
+	void view(Format format, uint8_t* data, int64_t rows, int cols);
+
+	// Dequantizes a row into out[LANES], the lanes past cols are undefined
+	void load_row(int64_t row, float* out) const;
+
+	float load(int64_t row, int col) const;
+
+	void store(int64_t row, int col, float value);
+
+	// Whole row at once, the int8 scale fits its largest value
+	void store_row(int64_t row, const float* values);
+
+	// Independent uniform values in [low, high)
+	void fill_uniform(float low, float high, std::mt19937& rng);
+
+	Format m_format;
+	uint8_t* m_data;
+	int64_t m_rows;
+	int m_cols;
+	uint32_t m_noise; // xorshift state of the stochastic rounding, never 0
+
+private:
+	uint32_t noise();
+};
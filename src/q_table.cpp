@@ -0,0 +1,142 @@
+// Header
+#include "q_table.hpp"
+
+// stdlib
+#include <string.h>
+
+namespace
+{
+	const int MIN_SHIFT = 64 - 12;
+
+	uint64_t mix(uint64_t x)
+	{
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ull;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebull;
+		return x ^ (x >> 31);
+	}
+}
+
+const int64_t Sparse_Q_Table::EMPTY;
+
+Sparse_Q_Table::Sparse_Q_Table() :
+	m_cols(0),
+	m_seed(0),
+	m_shift(MIN_SHIFT)
+{
+}
+
+void Sparse_Q_Table::init(int cols, uint64_t seed)
+{
+	m_cols = cols;
+	m_seed = seed;
+	m_shift = MIN_SHIFT;
+	m_keys.assign((size_t)1 << (64 - m_shift), EMPTY);
+	m_rows.assign(m_keys.size(), 0);
+	m_row_keys.clear();
+	m_arena.clear();
+}
+
+int64_t Sparse_Q_Table::find(int64_t key) const
+{
+	size_t mask = m_keys.size() - 1;
+	for (size_t slot = (size_t)(((uint64_t)key * 0x9e3779b97f4a7c15ull) >> m_shift);; slot = (slot + 1) & mask) {
+		if (m_keys[slot] == key)
+			return m_rows[slot];
+		if (m_keys[slot] == EMPTY)
+			return -1;
+	}
+}
+
+void Sparse_Q_Table::default_row(int64_t key, float* out) const
+{
+	uint64_t base = mix(m_seed ^ ((uint64_t)key * 0x9e3779b97f4a7c15ull));
+	for (int col = 0; col < Q_Store::LANES; ++col) {
+		out[col] = (float)(mix(base + col) >> 40) * (1.f / 16777216.f);
+	}
+}
+
+void Sparse_Q_Table::load_row(int64_t key, float* out) const
+{
+	int64_t row = find(key);
+	if (row < 0) {
+		default_row(key, out);
+		return;
+	}
+	memcpy(out, &m_arena[row * Q_Store::LANES], Q_Store::LANES * sizeof(float));
+}
+
+float* Sparse_Q_Table::row(int64_t key)
+{
+	size_t mask = m_keys.size() - 1;
+	size_t slot = (size_t)(((uint64_t)key * 0x9e3779b97f4a7c15ull) >> m_shift);
+	while (m_keys[slot] != key && m_keys[slot] != EMPTY) {
+		slot = (slot + 1) & mask;
+	}
+	if (m_keys[slot] == key)
+		return &m_arena[(size_t)m_rows[slot] * Q_Store::LANES];
+
+	int64_t row = size();
+	m_keys[slot] = key;
+	m_rows[slot] = (uint32_t)row;
+	m_row_keys.push_back(key);
+	m_arena.resize(m_arena.size() + Q_Store::LANES);
+	default_row(key, &m_arena[row * Q_Store::LANES]);
+	if ((size_t)size() * 2 > m_keys.size()) {
+		grow();
+	}
+	return &m_arena[row * Q_Store::LANES];
+}
+
+void Sparse_Q_Table::grow()
+{
+	m_shift--;
+	m_keys.assign((size_t)1 << (64 - m_shift), EMPTY);
+	m_rows.assign(m_keys.size(), 0);
+	size_t mask = m_keys.size() - 1;
+	for (int64_t row = 0; row < size(); ++row) {
+		int64_t key = m_row_keys[row];
+		size_t slot = (size_t)(((uint64_t)key * 0x9e3779b97f4a7c15ull) >> m_shift);
+		while (m_keys[slot] != EMPTY) {
+			slot = (slot + 1) & mask;
+		}
+		m_keys[slot] = key;
+		m_rows[slot] = (uint32_t)row;
+	}
+}
+
+size_t Sparse_Q_Table::bytes() const
+{
+	return m_keys.capacity() * sizeof(int64_t) + m_rows.capacity() * sizeof(uint32_t) +
+		m_row_keys.capacity() * sizeof(int64_t) + m_arena.capacity() * sizeof(float);
+}
+
+Q_Table::Q_Table() :
+	m_backend(DENSE)
+{
+}
+
+float Q_Table::load(int64_t row, int col) const
+{
+	if (m_backend == DENSE)
+		return m_dense.load(row, col);
+	float values[Q_Store::LANES];
+	m_sparse.load_row(row, values);
+	return values[col];
+}
+
+void Q_Table::store(int64_t row, int col, float value)
+{
+	if (m_backend == DENSE)
+		m_dense.store(row, col, value);
+	else
+		m_sparse.row(row)[col] = value;
+}
+
+size_t Q_Table::bytes() const
+{
+	if (m_backend == SPARSE)
+		return m_sparse.bytes();
+	return Q_Store::bytes(m_dense.m_format, m_dense.m_rows, m_dense.m_cols);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "q_store.hpp"
+
+// stdlib
+#include <stdint.h>
+#include <vector>
+
+// Q-values of the rows that were written, keyed by their State_Index row. Keys live in an open
+// addressing table (linear probing, at most half full) pointing into an arena of LANES float
+// rows, so a row is one contiguous 64-byte block whatever the table size. Rows that were never
+// written read as their default values, a hash of the seed, the row and the column uniform in
+// [0, 1), the same for the whole run without being stored.
+class Sparse_Q_Table
+{
+public:
+	Sparse_Q_Table();
+
+	// Empties the table
+	void init(int cols, uint64_t seed);
+
+	void load_row(int64_t key, float* out) const;
+
+	// Row of key, inserted with its default values the first time. Pointers are valid until the
+	// next insertion.
+	float* row(int64_t key);
+
+	// Bytes allocated for keys and rows
+	size_t bytes() const;
+
+	int64_t size() const { return (int64_t)m_row_keys.size(); }
+
+	int m_cols;
+	uint64_t m_seed;
+	std::vector<int64_t> m_row_keys; // key of every arena row, in insertion order
+	std::vector<float> m_arena; // LANES floats per row
+
+private:
+	static const int64_t EMPTY = -1;
+
+	// Arena row of key, -1 if it was never written
+	int64_t find(int64_t key) const;
+
+	void default_row(int64_t key, float* out) const;
+	void grow();
+
+	std::vector<int64_t> m_keys;
+	std::vector<uint32_t> m_rows; // arena row per key slot
+	int m_shift; // 64 - log2(slots)
+};
+
+// TabQ's table, dense over every indexed state in a Q_Store or sparse over the visited ones
+class Q_Table
+{
+public:
+	enum Backend { DENSE, SPARSE };
+
+	Q_Table();
+
+	void load_row(int64_t row, float* out) const
+	{
+		if (m_backend == SPARSE)
+			m_sparse.load_row(row, out);
+		else
+			m_dense.load_row(row, out);
+	}
+
+	float load(int64_t row, int col) const;
+
+	void store(int64_t row, int col, float value);
+
+	// Bytes holding the values
+	size_t bytes() const;
+
+	// fn(row, values) over every dense row or every written sparse row, in ascending order of
+	// rows for dense tables and of insertion for sparse ones
+	template<typename Fn>
+	void for_each(Fn fn) const
+	{
+		float values[Q_Store::LANES];
+		if (m_backend == SPARSE) {
+			for (int64_t i = 0; i < m_sparse.size(); ++i) {
+				fn(m_sparse.m_row_keys[i], &m_sparse.m_arena[i * Q_Store::LANES]);
+			}
+			return;
+		}
+		for (int64_t row = 0; row < m_dense.m_rows; ++row) {
+			m_dense.load_row(row, values);
+			fn(row, (const float*)values);
+		}
+	}
+
+	Backend m_backend;
+	Q_Store m_dense;
+	Sparse_Q_Table m_sparse;
+};
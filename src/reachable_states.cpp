@@ -0,0 +1,210 @@
+// Header
+#include "reachable_states.hpp"
+#include "mapped_file.hpp"
+
+// stdlib
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <thread>
+#include <stdio.h>
+#include <string.h>
+
+namespace
+{
+	const char* ENEMY_NAMES[4] = { "bat", "skeleton", "knight", "pathfinder" };
+	const int HERO_ACTIONS = 13;
+
+	// Frontier states handed to a thread at a time
+	const size_t CHUNK = 256;
+}
+
+std::string Reachable_States::cache_path(const Grid_World& world)
+{
+	std::vector<ivec2> starts = world.start_cells();
+	char name[128];
+	snprintf(name, sizeof(name), "-%d_%d-%d_%d.bin", starts[0].x, starts[0].y, starts[1].x, starts[1].y);
+	return std::string(data_path "/reachable/") + ENEMY_NAMES[world.m_enemy_type] + "-" + world.m_level_name + name;
+}
+
+Reachable_Header Reachable_States::key(const Grid_World& world)
+{
+	Reachable_Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "RSET", 4);
+	header.version = 1;
+	header.level_hash = world.m_level.hash();
+	header.policy_hash = world.m_enemy_type == 1 || world.m_enemy_type == 2 ? world.enemy_policy().hash() : 0;
+	header.enemy_type = world.m_enemy_type;
+	std::vector<ivec2> starts = world.start_cells();
+	header.starts[0] = starts[0].x;
+	header.starts[1] = starts[0].y;
+	header.starts[2] = starts[1].x;
+	header.starts[3] = starts[1].y;
+	header.n_cells = world.m_state_index.m_n_cells;
+	return header;
+}
+
+bool Reachable_States::compute(Grid_World& world, const std::string& algo, int n_threads)
+{
+	// A model backed enemy policy has no hash, its states are searched again every time
+	Reachable_Header header = key(world);
+	bool cacheable = !(world.m_enemy_type == 1 || world.m_enemy_type == 2) || header.policy_hash != 0;
+	std::string path = cache_path(world);
+	if (cacheable && load(path, header))
+		return true;
+
+	// Extra worlds are set up here, init() is not thread safe
+	n_threads = std::max(1, n_threads);
+	std::vector<std::unique_ptr<Grid_World>> extra;
+	std::vector<Grid_World*> worlds = { &world };
+	std::vector<ivec2> starts = world.start_cells();
+	for (int t = 1; t < n_threads; ++t) {
+		std::unique_ptr<Grid_World> copy(new Grid_World());
+		if (!copy->init(world.m_level_name + ".txt", algo, world.m_enemy_type, { starts[0].y, starts[0].x }, { starts[1].y, starts[1].x }))
+			break;
+		worlds.push_back(copy.get());
+		extra.push_back(std::move(copy));
+	}
+
+	bool ok = build(worlds);
+	for (std::unique_ptr<Grid_World>& copy : extra) {
+		copy->destroy();
+	}
+	if (ok && cacheable) {
+		// A missing cache only costs the next run the search
+		std::error_code error;
+		std::filesystem::create_directories(data_path "/reachable", error);
+		save(path, header);
+	}
+	return ok;
+}
+
+bool Reachable_States::build(const std::vector<Grid_World*>& worlds)
+{
+	const State_Index& index = worlds[0]->m_state_index;
+	std::vector<ivec2> starts = worlds[0]->start_cells();
+	m_states.clear();
+
+	// reset() draws the enemy action among the 4 moves
+	std::vector<int64_t> frontier;
+	for (int action = 1; action <= 4; ++action) {
+		int64_t start = index.index(starts[0].x, starts[0].y, starts[1].x, starts[1].y, action);
+		if (!index.is_exported(start)) {
+			fprintf(stderr, "Start cells are not free\n");
+			return false;
+		}
+		frontier.push_back(start);
+	}
+	m_states = frontier;
+
+	int n_threads = (int)worlds.size();
+	std::vector<std::vector<int64_t>> found(n_threads);
+	while (!frontier.empty()) {
+		std::atomic<size_t> next(0);
+		auto expand = [&](int thread) {
+			Grid_World& world = *worlds[thread];
+			std::vector<int64_t>& out = found[thread];
+			out.clear();
+			int64_t state[5];
+			for (size_t begin = next.fetch_add(CHUNK); begin < frontier.size(); begin = next.fetch_add(CHUNK)) {
+				size_t end = std::min(begin + CHUNK, frontier.size());
+				for (size_t i = begin; i < end; ++i) {
+					index.state(frontier[i], state);
+					for (int action = 0; action < HERO_ACTIONS; ++action) {
+						// Outcome 0 first, the other bounce outcomes only if the bat bounced
+						int n_outcomes = 1;
+						for (int outcome = 0; outcome < n_outcomes; ++outcome) {
+							world.force_bounce(outcome);
+							world.set_state(state);
+							world.update(action);
+
+							const Bounce* bounce = world.last_bounce();
+							if (bounce != nullptr && bounce->n > 1) {
+								n_outcomes = bounce->n;
+							}
+							int64_t successor = index.index(world.extract_state());
+							if (index.is_exported(successor)) {
+								out.push_back(successor);
+							}
+						}
+					}
+				}
+			}
+			world.force_bounce(-1);
+		};
+
+		// Small frontiers are not worth waking threads for
+		int n_workers = (int)std::min<size_t>(n_threads, (frontier.size() + CHUNK - 1) / CHUNK);
+		std::vector<std::thread> threads;
+		for (int t = 1; t < n_workers; ++t) {
+			threads.emplace_back(expand, t);
+		}
+		expand(0);
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+
+		// Next frontier, the successors not seen before
+		std::vector<int64_t> successors;
+		for (int t = 0; t < n_workers; ++t) {
+			successors.insert(successors.end(), found[t].begin(), found[t].end());
+		}
+		std::sort(successors.begin(), successors.end());
+		successors.erase(std::unique(successors.begin(), successors.end()), successors.end());
+		frontier.clear();
+		std::set_difference(successors.begin(), successors.end(), m_states.begin(), m_states.end(), std::back_inserter(frontier));
+
+		size_t middle = m_states.size();
+		m_states.insert(m_states.end(), frontier.begin(), frontier.end());
+		std::inplace_merge(m_states.begin(), m_states.begin() + middle, m_states.end());
+	}
+	return true;
+}
+
+bool Reachable_States::load(const std::string& path, const Reachable_Header& key)
+{
+	Mapped_File file;
+	if (!file.open(path.c_str()))
+		return false;
+
+	const Reachable_Header* header = (const Reachable_Header*)file.data;
+	if (file.size < sizeof(Reachable_Header) || memcmp(header->magic, "RSET", 4) != 0 || header->version != 1 ||
+		header->level_hash != key.level_hash || header->policy_hash != key.policy_hash || header->enemy_type != key.enemy_type ||
+		memcmp(header->starts, key.starts, sizeof(key.starts)) != 0 || header->n_cells != key.n_cells ||
+		(file.size - sizeof(Reachable_Header)) / sizeof(int64_t) != header->n_states) {
+		return false;
+	}
+
+	m_states.resize(header->n_states);
+	memcpy(m_states.data(), file.data + sizeof(Reachable_Header), header->n_states * sizeof(int64_t));
+	return true;
+}
+
+bool Reachable_States::save(const std::string& path, const Reachable_Header& key) const
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr) {
+		fprintf(stderr, "Failed to open %s for writing\n", path.c_str());
+		return false;
+	}
+
+	Reachable_Header header = key;
+	header.n_states = m_states.size();
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && fwrite(m_states.data(), sizeof(int64_t), m_states.size(), file) == m_states.size();
+	ok = fclose(file) == 0 && ok;
+	if (!ok) {
+		fprintf(stderr, "Failed to write %s\n", path.c_str());
+	}
+	return ok;
+}
+
+int64_t Reachable_States::row(int64_t index) const
+{
+	std::vector<int64_t>::const_iterator it = std::lower_bound(m_states.begin(), m_states.end(), index);
+	if (it == m_states.end() || *it != index)
+		return -1;
+	return it - m_states.begin();
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "grid_world.hpp"
+
+// stdlib
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Header of the reachable state caches in data/reachable, followed by n_states sorted int64
+// State_Index indices
+struct Reachable_Header
+{
+	char magic[4];			// "RSET"
+	uint32_t version;
+	uint64_t level_hash;	// Level::hash()
+	uint64_t policy_hash;	// Policy::hash() of the enemy policy, 0 for the bat and the pathfinder
+	int32_t enemy_type;
+	int32_t starts[4];		// hero row, col, enemy row, col
+	int32_t n_cells;		// State_Index::m_n_cells
+	uint64_t n_states;
+};
+
+// States reachable from the reset() states of a world under any hero action and any bat bounce,
+// found by a breadth-first search over the transition function. The search runs one frontier at
+// a time, split across threads that each step their own world. Successors outside the indexed
+// cells are dropped, like overflow states everywhere else.
+class Reachable_States
+{
+public:
+	// Reads the cache of world's level, enemy and start cells when it was computed for the same
+	// level and enemy policy, searches on n_threads and writes it otherwise. The extra worlds load
+	// the enemy policy of algo, as in Grid_World::init. world is left in an arbitrary state.
+	bool compute(Grid_World& world, const std::string& algo, int n_threads);
+
+	// Searches on every world, one per thread, all set up on the same level, enemy and starts
+	bool build(const std::vector<Grid_World*>& worlds);
+
+	bool load(const std::string& path, const Reachable_Header& key);
+	bool save(const std::string& path, const Reachable_Header& key) const;
+
+	// Compact row of an index state, its rank among the reachable states, -1 if it is not one
+	int64_t row(int64_t index) const;
+
+	int64_t size() const { return (int64_t)m_states.size(); }
+
+	// ./data/reachable/<enemy>-<level>-<hero row>_<col>-<enemy row>_<col>.bin
+	static std::string cache_path(const Grid_World& world);
+
+	// Cache header fields of world, n_states left 0
+	static Reachable_Header key(const Grid_World& world);
+
+	std::vector<int64_t> m_states; // ascending State_Index indices
+};
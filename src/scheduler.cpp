@@ -0,0 +1,148 @@
+// Header
+#include "scheduler.hpp"
+
+// internal
+#include "grid_world.hpp"
+#include "tabq.hpp"
+#include "deepQ.hpp"
+#include "metrics.hpp"
+
+// stdlib
+#include <algorithm>
+#include <chrono>
+#include <ctype.h>
+#include <memory>
+#include <stdio.h>
+
+namespace
+{
+	const char* ENEMY_NAMES[4] = { "bat", "skeleton", "knight", "pathfinder" };
+	const char* STATE_NAMES[5] = { "pending", "running", "done", "failed", "skipped" };
+
+	// "<enemy>_<level>_<algo>_" in front of a job's metric names, Prometheus names only take
+	// letters, digits and underscores
+	std::string metric_prefix(const Scheduler::Job& job, const std::string& level_name)
+	{
+		std::string prefix = std::string(ENEMY_NAMES[job.enemy_type]) + "_" + level_name + "_" + job.algo + "_";
+		for (char& c : prefix) {
+			if (!isalnum((unsigned char)c)) {
+				c = '_';
+			}
+		}
+		return prefix;
+	}
+}
+
+Scheduler::Scheduler(const std::vector<int>& hero_pos, const std::vector<int>& enemy_pos) :
+	m_hero_pos(hero_pos),
+	m_enemy_pos(enemy_pos),
+	m_seconds(0.0)
+{
+}
+
+void Scheduler::add(const std::vector<std::string>& levels, const std::vector<int>& enemy_types, const std::vector<std::string>& algos)
+{
+	std::vector<int> sorted = enemy_types;
+	std::sort(sorted.begin(), sorted.end());
+
+	for (const std::string& level : levels) {
+		for (const std::string& algo : algos) {
+			int previous = -1;
+			for (int enemy_type : sorted) {
+				Job job;
+				job.level = level;
+				job.enemy_type = enemy_type;
+				job.algo = algo;
+				job.dependency = -1;
+				job.seconds = 0.0;
+
+				// The policy this enemy plays is the one of the enemy type before it, the pathfinder
+				// plays none
+				if (previous >= 0 && enemy_type <= 2 && m_jobs[previous].enemy_type == enemy_type - 1) {
+					job.dependency = previous;
+				}
+
+				int id = m_pool.add([this, index = (int)m_jobs.size()] { return train(m_jobs[index]); });
+				if (job.dependency >= 0) {
+					m_pool.depend(id, job.dependency);
+				}
+				m_jobs.push_back(job);
+				previous = id;
+			}
+		}
+	}
+}
+
+bool Scheduler::train(Job& job)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<int> hero_pos = m_hero_pos;
+	std::vector<int> enemy_pos = m_enemy_pos;
+	if (hero_pos.empty()) {
+		const Level* level = Level::shared(levels_path(job.level));
+		if (level == nullptr || level->m_n_free < 2)
+			return false;
+		int hero = level->m_free_cells[0];
+		int enemy = level->m_free_cells[level->m_n_free - 1];
+		hero_pos = { hero % level->m_cols, hero / level->m_cols };
+		enemy_pos = { enemy % level->m_cols, enemy / level->m_cols };
+	}
+
+	// TabQ / deepQ release the world when they are done, failed or not
+	std::unique_ptr<Grid_World> world(new Grid_World());
+	if (!world->init(job.level, job.algo, job.enemy_type, hero_pos, enemy_pos)) {
+		fprintf(stderr, "Failed to set up %s %s %s\n", job.level.c_str(), ENEMY_NAMES[job.enemy_type], job.algo.c_str());
+		return false;
+	}
+
+	if (job.algo == "tabq") {
+		TabQ q(world.get(), false, Q_Store::FLOAT32, Q_Table::DENSE, 0.0, metric_prefix(job, world->m_level_name));
+		if (!q.train())
+			return false;
+	}
+	else if (job.algo == "dqn") {
+		deepQ q(world.get(), DQN_Model::directory(job.enemy_type, world->m_level_name), false, metric_prefix(job, world->m_level_name));
+		if (!q.train())
+			return false;
+	}
+	else {
+		fprintf(stderr, "Unknown algorithm %s\n", job.algo.c_str());
+		world->destroy();
+		return false;
+	}
+
+	job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return true;
+}
+
+bool Scheduler::run(int n_threads)
+{
+	// Trainers join this session instead of restarting the aggregator under each other
+	Metrics::start("./");
+	auto start = std::chrono::steady_clock::now();
+	bool ok = m_pool.run(n_threads);
+	m_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	Metrics::stop();
+	return ok;
+}
+
+void Scheduler::print() const
+{
+	double sum = 0.0;
+	double critical_path = 0.0;
+	std::vector<double> finish(m_jobs.size(), 0.0);
+
+	printf("%-14s %-9s %-5s %-8s %10s\n", "level", "enemy", "algo", "state", "seconds");
+	for (size_t id = 0; id < m_jobs.size(); ++id) {
+		const Job& job = m_jobs[id];
+		printf("%-14s %-9s %-5s %-8s %10.1f\n", job.level.c_str(), ENEMY_NAMES[job.enemy_type], job.algo.c_str(),
+			STATE_NAMES[m_pool.state((int)id)], job.seconds);
+
+		// Dependencies always come first
+		finish[id] = job.seconds + (job.dependency >= 0 ? finish[job.dependency] : 0.0);
+		critical_path = std::max(critical_path, finish[id]);
+		sum += job.seconds;
+	}
+	printf("wall %.1f s, jobs %.1f s, critical path %.1f s\n", m_seconds, sum, critical_path);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "job_pool.hpp"
+
+// stdlib
+#include <string>
+#include <vector>
+
+// Trains a matrix of (level, enemy type, algorithm) jobs on a Job_Pool. A skeleton world's enemy
+// plays the bat policy of the same level and algorithm and a knight's the skeleton one, so each
+// job depends on the job writing that policy when it is part of the matrix. Pathfinder jobs depend
+// on nothing. Jobs share the process wide level images.
+class Scheduler
+{
+public:
+	struct Job
+	{
+		std::string level;
+		int enemy_type;
+		std::string algo;
+		int dependency; // job training the enemy's policy, -1 if it is not in the matrix
+		double seconds;
+	};
+
+	// Start cells are argv style { col, row }, empty to start each level's hero on its first
+	// free cell and the enemy on its last
+	Scheduler(const std::vector<int>& hero_pos, const std::vector<int>& enemy_pos);
+
+	void add(const std::vector<std::string>& levels, const std::vector<int>& enemy_types, const std::vector<std::string>& algos);
+
+	bool run(int n_threads);
+
+	// Per job state and time, then the wall clock against the sum and critical path of the jobs
+	void print() const;
+
+	std::vector<Job> m_jobs;
+
+private:
+	bool train(Job& job);
+
+	std::vector<int> m_hero_pos;
+	std::vector<int> m_enemy_pos;
+	Job_Pool m_pool;
+	double m_seconds;
+};
@@ -0,0 +1,224 @@
+// Header
+#include "soft_renderer.hpp"
+#include "grid_world.hpp"
+
+// stb_image is implemented in common.cpp
+#include "../ext/stb_image/stb_image.h"
+
+// stdlib
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SOFT_RENDERER_SSE2
+#endif
+
+namespace
+{
+	// Same atlas layout and sprite coordinates as Grid_State::init / Grid_World::init
+	const int ATLAS_COLS = 16;
+	const int ATLAS_ROWS = 8;
+	const int HERO_TILE = 3 * ATLAS_COLS + 5;
+	const int ENEMY_TILES[] = { 3 * ATLAS_COLS + 3, 5 * ATLAS_COLS + 4, 5 * ATLAS_COLS + 12, 5 * ATLAS_COLS + 12 };
+	static_assert(sizeof(ENEMY_TILES) / sizeof(ENEMY_TILES[0]) == N_ENEMY_TYPES, "one enemy tile per enemy type");
+
+	// Clear colour of Grid_World::draw
+	const float CLEAR_COLOR[3] = { 0.3f, 0.3f, 0.8f };
+
+	uint8_t to_byte(float v)
+	{
+		v = v * 255.f + 0.5f;
+		return v <= 0.f ? 0 : (v >= 255.f ? 255 : (uint8_t)v);
+	}
+
+	float luminance(float r, float g, float b)
+	{
+		return 0.299f * r + 0.587f * g + 0.114f * b;
+	}
+
+	// Exact x / 255 rounded, for x in [0, 255 * 255]
+	inline unsigned div255(unsigned x)
+	{
+		x += 128;
+		return (x + (x >> 8)) >> 8;
+	}
+
+	void blit_row(uint8_t* dst, const uint8_t* src, int n)
+	{
+		int i = 0;
+#ifdef SOFT_RENDERER_SSE2
+		for (; i + 16 <= n; i += 16) {
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(src + i)));
+		}
+#endif
+		memcpy(dst + i, src + i, n - i);
+	}
+
+	// dst = premul + dst * inv_alpha / 255, byte-wise so it works for any channel count
+	void blend_row(uint8_t* dst, const uint8_t* premul, const uint8_t* inv_alpha, int n)
+	{
+		int i = 0;
+#ifdef SOFT_RENDERER_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i half = _mm_set1_epi16(128);
+		for (; i + 16 <= n; i += 16) {
+			__m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+			__m128i a = _mm_loadu_si128((const __m128i*)(inv_alpha + i));
+			__m128i p = _mm_loadu_si128((const __m128i*)(premul + i));
+
+			__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(a, zero)), half);
+			__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(a, zero)), half);
+			lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+			hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_adds_epu8(_mm_packus_epi16(lo, hi), p));
+		}
+#endif
+		for (; i < n; ++i) {
+			unsigned v = premul[i] + div255(dst[i] * inv_alpha[i]);
+			dst[i] = v > 255 ? 255 : (uint8_t)v;
+		}
+	}
+}
+
+Soft_Renderer::Soft_Renderer() : m_channels(0), m_tile_size(0), m_tile_bytes(0) { }
+Soft_Renderer::~Soft_Renderer() { }
+
+bool Soft_Renderer::init(Format format, int downscale)
+{
+	int width, height;
+	stbi_uc* atlas = stbi_load(textures_path("tileset_1bit.png"), &width, &height, NULL, 4);
+	if (atlas == NULL) {
+		fprintf(stderr, "Failed to load world texture!");
+		return false;
+	}
+
+	int tile_px = width / ATLAS_COLS;
+	if (downscale < 1 || tile_px % downscale != 0 || height / ATLAS_ROWS != tile_px) {
+		fprintf(stderr, "Unsupported downscale factor %d for %dpx tiles", downscale, tile_px);
+		stbi_image_free(atlas);
+		return false;
+	}
+
+	m_channels = (int)format;
+	m_tile_size = tile_px / downscale;
+	m_tile_bytes = m_tile_size * m_tile_size * m_channels;
+	bake(atlas, width, tile_px, downscale);
+
+	stbi_image_free(atlas);
+	return true;
+}
+
+void Soft_Renderer::bake(const uint8_t* atlas, int atlas_width, int tile_px, int downscale)
+{
+	int n_tiles = ATLAS_COLS * ATLAS_ROWS;
+	m_tiles.assign(n_tiles * m_tile_bytes, 0);
+	m_premul.assign(n_tiles * m_tile_bytes, 0);
+	m_inv_alpha.assign(n_tiles * m_tile_bytes, 0);
+
+	float area = (float)(downscale * downscale);
+	for (int tile = 0; tile < n_tiles; ++tile) {
+		int u = (tile % ATLAS_COLS) * tile_px;
+		int v = (tile / ATLAS_COLS) * tile_px;
+		for (int y = 0; y < m_tile_size; ++y) {
+			for (int x = 0; x < m_tile_size; ++x) {
+				// Box filter of premultiplied colour and coverage
+				float premul[3] = { 0.f, 0.f, 0.f };
+				float alpha = 0.f;
+				for (int dy = 0; dy < downscale; ++dy) {
+					const uint8_t* texel = atlas + ((v + y * downscale + dy) * atlas_width + u + x * downscale) * 4;
+					for (int dx = 0; dx < downscale; ++dx, texel += 4) {
+						float a = texel[3] / 255.f;
+						for (int c = 0; c < 3; ++c) {
+							premul[c] += texel[c] / 255.f * a;
+						}
+						alpha += a;
+					}
+				}
+				alpha /= area;
+				float opaque[3];
+				for (int c = 0; c < 3; ++c) {
+					premul[c] /= area;
+					opaque[c] = premul[c] + CLEAR_COLOR[c] * (1.f - alpha);
+				}
+
+				size_t offset = tile * m_tile_bytes + (y * m_tile_size + x) * m_channels;
+				uint8_t inv_alpha = to_byte(1.f - alpha);
+				if (m_channels == GRAY) {
+					m_tiles[offset] = to_byte(luminance(opaque[0], opaque[1], opaque[2]));
+					m_premul[offset] = to_byte(luminance(premul[0], premul[1], premul[2]));
+					m_inv_alpha[offset] = inv_alpha;
+				}
+				else {
+					for (int c = 0; c < 3; ++c) {
+						m_tiles[offset + c] = to_byte(opaque[c]);
+						m_premul[offset + c] = to_byte(premul[c]);
+						m_inv_alpha[offset + c] = inv_alpha;
+					}
+				}
+			}
+		}
+	}
+}
+
+int Soft_Renderer::frame_width(const Grid_World& world) const
+{
+	return world.m_cols * m_tile_size;
+}
+
+int Soft_Renderer::frame_height(const Grid_World& world) const
+{
+	return world.m_rows * m_tile_size;
+}
+
+size_t Soft_Renderer::frame_size(const Grid_World& world) const
+{
+	return (size_t)frame_width(world) * frame_height(world) * m_channels;
+}
+
+void Soft_Renderer::blend(uint8_t* frame, int stride, int row, int col, int sprite) const
+{
+	int line_bytes = m_tile_size * m_channels;
+	uint8_t* dst = frame + (size_t)row * m_tile_size * stride + col * line_bytes;
+	const uint8_t* premul = m_premul.data() + sprite * m_tile_bytes;
+	const uint8_t* inv_alpha = m_inv_alpha.data() + sprite * m_tile_bytes;
+	for (int y = 0; y < m_tile_size; ++y) {
+		blend_row(dst + y * stride, premul + y * line_bytes, inv_alpha + y * line_bytes, line_bytes);
+	}
+}
+
+void Soft_Renderer::render(const Grid_World& world, uint8_t* frame) const
+{
+	int line_bytes = m_tile_size * m_channels;
+	int stride = world.m_cols * line_bytes;
+	const uint8_t* tiles = world.m_level.m_tiles;
+
+	// Tile lines are written in frame order so the output is streamed once
+	uint8_t* dst = frame;
+	for (int row = 0; row < world.m_rows; ++row) {
+		const uint8_t* row_tiles = tiles + row * world.m_cols;
+		for (int y = 0; y < m_tile_size; ++y) {
+			for (int col = 0; col < world.m_cols; ++col) {
+				blit_row(dst, m_tiles.data() + row_tiles[col] * m_tile_bytes + y * line_bytes, line_bytes);
+				dst += line_bytes;
+			}
+		}
+	}
+
+	// Same order as Grid_World::draw, enemy then hero on top
+	std::vector<int64_t> state = world.extract_state();
+	blend(frame, stride, (int)state[2], (int)state[3], ENEMY_TILES[world.m_enemy_type]);
+	blend(frame, stride, (int)state[0], (int)state[1], HERO_TILE);
+}
+
+void Soft_Renderer::render_batch(const Grid_World* const* worlds, int n, uint8_t* tensor) const
+{
+	if (n <= 0)
+		return;
+
+	size_t size = frame_size(*worlds[0]);
+	for (int i = 0; i < n; ++i) {
+		assert(worlds[i]->m_rows == worlds[0]->m_rows && worlds[i]->m_cols == worlds[0]->m_cols);
+		render(*worlds[i], tensor + i * size);
+	}
+}
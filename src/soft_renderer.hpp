@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.hpp"
+
+// stdlib
+#include <vector>
+#include <stdint.h>
+
+class Grid_World;
+
+// CPU counterpart of Grid_World::draw for headless pixel observations.
+// Tiles are cut from the same 16x8 tileset atlas as the OpenGL path, baked once
+// at init for the chosen format / downscale, then blitted into caller owned frames.
+class Soft_Renderer
+{
+public:
+	enum Format { GRAY = 1, RGB = 3 };
+
+	Soft_Renderer();
+	~Soft_Renderer();
+
+	// Decodes the tileset, downscale is the box filter factor and must divide the tile size (16)
+	bool init(Format format = RGB, int downscale = 1);
+
+	int frame_width(const Grid_World& world) const;
+	int frame_height(const Grid_World& world) const;
+	size_t frame_size(const Grid_World& world) const;
+
+	// Composites one world into frame, laid out [height][width][channels]
+	void render(const Grid_World& world, uint8_t* frame) const;
+
+	// Composites n worlds of identical dimensions into a contiguous [n][height][width][channels] tensor
+	void render_batch(const Grid_World* const* worlds, int n, uint8_t* tensor) const;
+
+	int m_channels;
+	int m_tile_size;
+
+private:
+	void bake(const uint8_t* atlas, int atlas_width, int tile_px, int downscale);
+	void blend(uint8_t* frame, int stride, int row, int col, int sprite) const;
+
+	int m_tile_bytes;
+
+	// 16x8 opaque tiles composited over the clear colour
+	std::vector<uint8_t> m_tiles;
+	// The same tiles premultiplied by alpha, with 255 - alpha replicated per channel
+	std::vector<uint8_t> m_premul;
+	std::vector<uint8_t> m_inv_alpha;
+};
@@ -0,0 +1,76 @@
+// Header
+#include "state_index.hpp"
+
+State_Index::State_Index() : m_rows(0), m_cols(0), m_n_cells(1), m_overflow(0), m_n_actions(0) { }
+
+void State_Index::build(const Level& level, int n_actions, const std::vector<ivec2>& starts)
+{
+	m_rows = level.m_rows;
+	m_cols = level.m_cols;
+	m_n_actions = n_actions;
+
+	int n_grid = m_rows * m_cols;
+	std::vector<uint8_t> keep(n_grid, 0);
+	if (starts.empty()) {
+		for (int i = 0; i < level.m_n_free; ++i) {
+			keep[level.m_free_cells[i]] = 1;
+		}
+	}
+	else {
+		// Flood fill over the free neighbour masks
+		std::vector<int> stack;
+		for (const ivec2& start : starts) {
+			if ((unsigned)start.x < (unsigned)m_rows && (unsigned)start.y < (unsigned)m_cols && !level.is_obstacle(start.x, start.y)) {
+				stack.push_back(start.x * m_cols + start.y);
+			}
+		}
+		while (!stack.empty()) {
+			int cell = stack.back();
+			stack.pop_back();
+			if (keep[cell])
+				continue;
+			keep[cell] = 1;
+
+			uint8_t free = level.free_neighbors(cell / m_cols, cell % m_cols);
+			if (free & Level::FREE_UP)		stack.push_back(cell - m_cols);
+			if (free & Level::FREE_LEFT)	stack.push_back(cell - 1);
+			if (free & Level::FREE_DOWN)	stack.push_back(cell + m_cols);
+			if (free & Level::FREE_RIGHT)	stack.push_back(cell + 1);
+		}
+	}
+
+	m_cells.clear();
+	m_cell_index.assign(n_grid, -1);
+	for (int cell = 0; cell < n_grid; ++cell) {
+		if (keep[cell]) {
+			m_cell_index[cell] = (int32_t)m_cells.size();
+			m_cells.push_back(cell);
+		}
+	}
+
+	m_overflow = (int)m_cells.size();
+	m_n_cells = m_overflow + 1;
+	for (int cell = 0; cell < n_grid; ++cell) {
+		if (m_cell_index[cell] < 0) {
+			m_cell_index[cell] = m_overflow;
+		}
+	}
+}
+
+bool State_Index::is_exported(int64_t index) const
+{
+	int64_t cells = index / m_n_actions;
+	return cells / m_n_cells != m_overflow && cells % m_n_cells != m_overflow;
+}
+
+void State_Index::state(int64_t index, int64_t* out) const
+{
+	int64_t cells = index / m_n_actions;
+	int hero = m_cells[cells / m_n_cells];
+	int enemy = m_cells[cells % m_n_cells];
+	out[0] = hero / m_cols;
+	out[1] = hero % m_cols;
+	out[2] = enemy / m_cols;
+	out[3] = enemy % m_cols;
+	out[4] = index % m_n_actions;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "common.hpp"
+#include "level.hpp"
+
+// stdlib
+#include <vector>
+
+// Dense numbering of the (hero row, hero col, enemy row, enemy col, enemy action) states of
+// extract_state() over walkable cells only. Any other cell (a hero shoved into a wall, a
+// transposed lookup outside the grid) maps to one shared overflow cell so every state stays
+// addressable, the overflow states are simply never exported.
+class State_Index
+{
+public:
+	State_Index();
+
+	// Indexes all free cells, or only those connected to one of starts when it is not empty
+	void build(const Level& level, int n_actions, const std::vector<ivec2>& starts = std::vector<ivec2>());
+
+	int64_t size() const { return (int64_t)m_n_cells * m_n_cells * m_n_actions; }
+
+	int cell(int row, int col) const
+	{
+		if ((unsigned)row >= (unsigned)m_rows || (unsigned)col >= (unsigned)m_cols)
+			return m_overflow;
+		return m_cell_index[row * m_cols + col];
+	}
+
+	int64_t index(int hero_row, int hero_col, int enemy_row, int enemy_col, int enemy_action) const
+	{
+		return ((int64_t)cell(hero_row, hero_col) * m_n_cells + cell(enemy_row, enemy_col)) * m_n_actions + enemy_action;
+	}
+
+	int64_t index(const std::vector<int64_t>& state) const
+	{
+		return index((int)state[0], (int)state[1], (int)state[2], (int)state[3], (int)state[4]);
+	}
+
+	// True if neither the hero nor the enemy of the state sits in the overflow cell
+	bool is_exported(int64_t index) const;
+
+	// Inverse of index() for exported states, fills the 5 components of extract_state()
+	void state(int64_t index, int64_t* out) const;
+
+	int m_rows;
+	int m_cols;
+	int m_n_cells; // indexed cells, the overflow cell included
+	int m_overflow;
+	int m_n_actions;
+
+	std::vector<int32_t> m_cell_index; // per grid cell
+	std::vector<int32_t> m_cells; // indexed cell to grid cell
+};
@@ -0,0 +1,262 @@
+// Header
+#include "symmetry.hpp"
+
+// internal
+#include "grid_world.hpp"
+
+// stdlib
+#include <algorithm>
+#include <random>
+
+namespace
+{
+	// Move directions of actions 1-4, as (row, col) steps
+	const ivec2 DIRECTIONS[4] = { { -1, 0 }, { 0, -1 }, { 1, 0 }, { 0, 1 } };
+
+	// Transforms 1 and 3 undo each other, every other one is its own inverse
+	const int INVERSE[Symmetry::N_TRANSFORMS] = { 0, 3, 2, 1, 4, 5, 6, 7 };
+
+	// Bounce probabilities only depend on the free neighbour mask, which turns with the level, so
+	// matching successors also match in probability. Comparing the successors alone also holds
+	// when a step bounces twice and the forced outcome indices do not line up with one table.
+	struct Outcome
+	{
+		int64_t next; // State_Index index, so leaving the indexed cells is one outcome however it happens
+		int reward;
+
+		bool operator<(const Outcome& o) const
+		{
+			return next != o.next ? next < o.next : reward < o.reward;
+		}
+	};
+
+	// Successors of state under action, one per bat bounce outcome
+	void outcomes(Grid_World& world, const State_Index& index, const int64_t* state, int action, std::vector<Outcome>& out)
+	{
+		out.clear();
+		int n_outcomes = 1;
+		for (int outcome = 0; outcome < n_outcomes; ++outcome) {
+			world.force_bounce(outcome);
+			world.set_state(state);
+			world.m_points = 0;
+			world.update(action);
+
+			const Bounce* bounce = world.last_bounce();
+			if (bounce != nullptr && bounce->n > 1) {
+				n_outcomes = bounce->n;
+			}
+			out.push_back({ index.index(world.extract_state()), world.m_points });
+		}
+	}
+}
+
+Symmetry::Symmetry() :
+	m_broken(),
+	m_mask(1),
+	m_index(nullptr),
+	m_size({ 0, 0 }),
+	m_n_pairs(0)
+{
+}
+
+void Symmetry::init(const State_Index& index)
+{
+	m_index = &index;
+	m_pair_row.clear();
+	m_n_pairs = 0;
+
+	// The whole level rather than the indexed cells, so policies read back over another index of
+	// the same level turn the same way
+	m_size = { index.m_rows, index.m_cols };
+
+	for (int t = 0; t < N_TRANSFORMS; ++t) {
+		m_inverse[t] = INVERSE[t];
+
+		// Move, attack and guard actions turn with their direction
+		ivec2 zero = apply(t, { 0, 0 });
+		int directions[4];
+		for (int d = 0; d < 4; ++d) {
+			ivec2 turned = sub(apply(t, DIRECTIONS[d]), zero);
+			directions[d] = (int)(std::find(DIRECTIONS, DIRECTIONS + 4, turned) - DIRECTIONS);
+		}
+		for (int a = 0; a < 16; ++a) {
+			m_actions[t][a] = a >= 1 && a <= 12 ? 1 + (a - 1) / 4 * 4 + directions[(a - 1) % 4] : a;
+		}
+	}
+	keep(1);
+}
+
+void Symmetry::keep(uint32_t mask)
+{
+	const State_Index& index = *m_index;
+	m_mask = 0;
+	m_kept.clear();
+	for (int t = 0; t < N_TRANSFORMS; ++t) {
+		m_cell_map[t].clear();
+		bool square = t == 0 || t == 2 || t == 4 || t == 5 || m_size.x == m_size.y;
+		if (!((mask >> t) & 1) || !square)
+			continue;
+
+		// The indexed cells have to map onto themselves, the overflow cell stays put
+		std::vector<int32_t> map(index.m_n_cells, index.m_overflow);
+		bool onto = true;
+		for (int cell = 0; cell < index.m_overflow && onto; ++cell) {
+			ivec2 image = apply(t, { index.m_cells[cell] / index.m_cols, index.m_cells[cell] % index.m_cols });
+			map[cell] = index.cell(image.x, image.y);
+			onto = map[cell] != index.m_overflow;
+		}
+		if (!onto && t != 0)
+			continue;
+
+		m_cell_map[t] = map;
+		m_kept.push_back(t);
+		m_mask |= 1u << t;
+	}
+}
+
+void Symmetry::build(const State_Index& index, uint32_t mask)
+{
+	init(index);
+	keep(mask | 1);
+}
+
+void Symmetry::detect(Grid_World& world, const State_Index& index, double tolerance, int64_t max_states)
+{
+	init(index);
+	keep(0xFF);
+	for (int t = 0; t < N_TRANSFORMS; ++t) {
+		m_broken[t] = (m_mask >> t) & 1 ? 0.0 : 1.0;
+	}
+	if (m_kept.size() == 1)
+		return;
+
+	std::vector<int64_t> states;
+	for (int64_t i = 0; i < index.size(); ++i) {
+		if (index.is_exported(i)) {
+			states.push_back(i);
+		}
+	}
+	if ((int64_t)states.size() > max_states) {
+		std::mt19937 rng(1);
+		std::shuffle(states.begin(), states.end(), rng);
+		states.resize(max_states);
+	}
+
+	// A transform is dropped as soon as it broke more transitions than the tolerance allows
+	int64_t checked = (int64_t)states.size() * index.m_n_actions;
+	int64_t allowed = (int64_t)(tolerance * (double)checked);
+	int64_t broken[N_TRANSFORMS] = {};
+	uint32_t mask = m_mask;
+	int64_t state[5];
+	std::vector<Outcome> expected;
+	std::vector<Outcome> turned;
+	std::vector<Outcome> actual;
+	for (size_t s = 0; s < states.size() && mask != 1; ++s) {
+		index.state(states[s], state);
+		for (int action = 0; action < index.m_n_actions && mask != 1; ++action) {
+			outcomes(world, index, state, action, expected);
+			for (size_t k = 1; k < m_kept.size(); ++k) {
+				int t = m_kept[k];
+				if (!((mask >> t) & 1))
+					continue;
+
+				// The image of the transition has to be the transition of the image
+				int64_t moved[5];
+				index.state(image(t, states[s]), moved);
+				outcomes(world, index, moved, m_actions[t][action], actual);
+				turned = expected;
+				for (Outcome& o : turned) {
+					o.next = image(t, o.next);
+				}
+				std::sort(turned.begin(), turned.end());
+				std::sort(actual.begin(), actual.end());
+
+				bool same = turned.size() == actual.size();
+				for (size_t i = 0; i < turned.size() && same; ++i) {
+					same = turned[i].next == actual[i].next && turned[i].reward == actual[i].reward;
+				}
+				if (!same && ++broken[t] > allowed) {
+					mask &= ~(1u << t);
+				}
+			}
+		}
+	}
+	world.force_bounce(-1);
+	for (size_t k = 1; k < m_kept.size(); ++k) {
+		int t = m_kept[k];
+		m_broken[t] = (double)broken[t] / (double)checked;
+	}
+	keep(mask);
+}
+
+ivec2 Symmetry::apply(int t, ivec2 cell) const
+{
+	int u = cell.x;
+	int v = cell.y;
+	int h = m_size.x - 1;
+	int w = m_size.y - 1;
+	ivec2 out;
+	switch (t) {
+		case 1: out = { v, h - u }; break;
+		case 2: out = { h - u, w - v }; break;
+		case 3: out = { w - v, u }; break;
+		case 4: out = { h - u, v }; break;
+		case 5: out = { u, w - v }; break;
+		case 6: out = { v, u }; break;
+		case 7: out = { w - v, h - u }; break;
+		default: out = { u, v }; break;
+	}
+	return out;
+}
+
+int64_t Symmetry::canonical(int64_t index, int& transform) const
+{
+	int n_actions = m_index->m_n_actions;
+	int64_t n_cells = m_index->m_n_cells;
+	int64_t cells = index / n_actions;
+	int hero = (int)(cells / n_cells);
+	int enemy = (int)(cells % n_cells);
+	int enemy_action = (int)(index % n_actions);
+
+	int64_t best = index;
+	transform = 0;
+	for (size_t k = 1; k < m_kept.size(); ++k) {
+		int t = m_kept[k];
+		int64_t image = ((int64_t)m_cell_map[t][hero] * n_cells + m_cell_map[t][enemy]) * n_actions + m_actions[t][enemy_action];
+		if (image < best) {
+			best = image;
+			transform = t;
+		}
+	}
+	return best;
+}
+
+int64_t Symmetry::image(int t, int64_t index) const
+{
+	int n_actions = m_index->m_n_actions;
+	int64_t n_cells = m_index->m_n_cells;
+	int64_t cells = index / n_actions;
+	int hero = m_cell_map[t][cells / n_cells];
+	int enemy = m_cell_map[t][cells % n_cells];
+	return ((int64_t)hero * n_cells + enemy) * n_actions + m_actions[t][index % n_actions];
+}
+
+void Symmetry::build_compact()
+{
+	// Indices are pair major, so a canonical state always sits on the lowest pair of its orbit
+	int64_t n_cells = m_index->m_n_cells;
+	m_pair_row.assign(n_cells * n_cells, -1);
+	m_n_pairs = 0;
+	for (int64_t pair = 0; pair < n_cells * n_cells; ++pair) {
+		int hero = (int)(pair / n_cells);
+		int enemy = (int)(pair % n_cells);
+		bool lowest = true;
+		for (size_t k = 1; k < m_kept.size() && lowest; ++k) {
+			int t = m_kept[k];
+			lowest = (int64_t)m_cell_map[t][hero] * n_cells + m_cell_map[t][enemy] >= pair;
+		}
+		if (lowest) {
+			m_pair_row[pair] = m_n_pairs++;
+		}
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "state_index.hpp"
+
+// stdlib
+#include <stdint.h>
+#include <vector>
+
+class Grid_World;
+
+// Rotations and mirrors of a level that leave the game unchanged. Transforms act on the level
+// grid: 0 identity, 1-3 rotations by 90, 180 and 270 degrees clockwise, 4 / 5
+// mirror the rows / the columns, 6 / 7 the two diagonals. Rotations by 90 degrees and diagonals
+// need a square level. Actions turn with their direction, so a state and its images share one
+// canonical state, the image with the lowest State_Index index.
+class Symmetry
+{
+public:
+	static const int N_TRANSFORMS = 8;
+
+	Symmetry();
+
+	// Keeps the transforms of mask (bit t for transform t, the identity always) that map the
+	// indexed cells onto themselves, without checking the rules. Enough to read back what was
+	// written under the transforms detect() kept. index has to outlive the symmetry.
+	void build(const State_Index& index, uint32_t mask);
+
+	// Keeps the transforms every transition of world commutes with: same reward, same successors.
+	// Transitions are checked from every exported state, or from max_states of them drawn at
+	// random on larger levels. tolerance is the share of transitions a transform may break and
+	// still be kept, 0 for exact symmetries only. Leaves the world in an arbitrary state.
+	void detect(Grid_World& world, const State_Index& index, double tolerance = 0.0, int64_t max_states = 1 << 20);
+
+	// Share of the checked transitions each transform broke in the last detect(), counted up to
+	// where it was dropped, 1 for transforms the level shape already rules out
+	double m_broken[N_TRANSFORMS];
+
+	// Canonical index of an index state and the transform leading to it
+	int64_t canonical(int64_t index, int& transform) const;
+
+	// Actions into the frame of transform t and back
+	int action(int t, int action) const { return m_actions[t][action]; }
+	int inverse_action(int t, int action) const { return m_actions[m_inverse[t]][action]; }
+
+	// Transform t of a (row, col) grid position
+	ivec2 apply(int t, ivec2 cell) const;
+
+	// Transform t of an index state, t has to be kept
+	int64_t image(int t, int64_t index) const;
+
+	// Dense numbering of the canonical states, n_cells^2 int32 to build
+	void build_compact();
+	int64_t compact_size() const { return (int64_t)m_n_pairs * m_index->m_n_actions; }
+	int64_t compact(int64_t index, int& transform) const
+	{
+		int64_t c = canonical(index, transform);
+		return (int64_t)m_pair_row[c / m_index->m_n_actions] * m_index->m_n_actions + c % m_index->m_n_actions;
+	}
+
+	// Kept transforms, 1 without symmetries, the identity first
+	int order() const { return (int)m_kept.size(); }
+	int transform(int k) const { return m_kept[k]; }
+
+	uint32_t m_mask; // bit t set for the kept transforms
+
+private:
+	void init(const State_Index& index);
+	void keep(uint32_t mask);
+
+	const State_Index* m_index;
+	ivec2 m_size; // level rows and cols
+	int m_actions[N_TRANSFORMS][16];
+	int m_inverse[N_TRANSFORMS];
+	std::vector<int> m_kept;
+	std::vector<int32_t> m_cell_map[N_TRANSFORMS]; // indexed cell to indexed cell, kept transforms only
+
+	int m_n_pairs;
+	std::vector<int32_t> m_pair_row; // per canonical (hero cell, enemy cell) pair, its compact pair
+};
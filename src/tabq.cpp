@@ -1,70 +1,366 @@
 #include "tabq.hpp"
+#include "policy.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <sstream>
+#include <thread>
 #include <vector>
+#include <string.h>
 
-using namespace torch;
-
-int arg_max(torch::TensorAccessor<float, 1> tensor) {
+// Among the actions set in valid, action 0 always is
+int arg_max(const float* values, int n, uint32_t valid = ~0u) {
 	int idx = 0;
 	float max_score = 0;
-	for (int i = 0; i < tensor.size(0); i++) {
-		if (tensor[i] > max_score) {
-			max_score = tensor[i];
+	for (int i = 0; i < n; i++) {
+		if (((valid >> i) & 1) && values[i] > max_score) {
+			max_score = values[i];
 			idx = i;
 		}
 	}
 	return idx;
 }
 
-TabQ::TabQ(Grid_World* world) {
+TabQ::TabQ(Grid_World* world, bool reachable, Q_Store::Format format, Q_Table::Backend backend, double symmetry_tolerance,
+	const std::string& metric_prefix) {
 	m_world = world;
 
 	m_action_dim = 13;
-	std::vector<int64_t> state_dims;
-	state_dims.push_back(m_world->m_rows);
-	state_dims.push_back(m_world->m_cols);
-	state_dims.push_back(m_world->m_rows);
-	state_dims.push_back(m_world->m_cols);
-	state_dims.push_back(13);
-	state_dims.push_back(13);
-
-	Q = torch::rand(state_dims);
+	// One row of action values per (hero cell, enemy cell, enemy action), walls are left out
+	m_index.build(m_world->m_level, 13, reachable ? m_world->start_cells() : std::vector<ivec2>());
+
+	// Dense tables only keep rows for the canonical states
+	int64_t rows = m_index.size();
+	if (symmetry_tolerance < 0) {
+		m_symmetry.build(m_index, 1);
+	}
+	else {
+		m_symmetry.detect(*m_world, m_index, symmetry_tolerance);
+	}
+	for (int t = 1; t < Symmetry::N_TRANSFORMS; ++t) {
+		if (((m_symmetry.m_mask >> t) & 1) && m_symmetry.m_broken[t] > 0) {
+			fprintf(stderr, "Symmetry %d kept, it breaks %.4f of the transitions\n", t, m_symmetry.m_broken[t]);
+		}
+	}
+
+	// Reachable states are found over the world's index, rows follow m_index
+	Reachable_States reachable_states;
+	if (reachable && backend == Q_Table::DENSE && reachable_states.compute(*m_world, "tabq", (int)std::thread::hardware_concurrency())) {
+		int64_t state[5];
+		for (int64_t idx : reachable_states.m_states) {
+			m_world->m_state_index.state(idx, state);
+			int transform;
+			int64_t local = m_index.index((int)state[0], (int)state[1], (int)state[2], (int)state[3], (int)state[4]);
+			m_states.push_back(m_symmetry.order() > 1 ? m_symmetry.canonical(local, transform) : local);
+		}
+		std::sort(m_states.begin(), m_states.end());
+		m_states.erase(std::unique(m_states.begin(), m_states.end()), m_states.end());
+		rows = (int64_t)m_states.size() + 1;
+	}
+	else if (m_symmetry.order() > 1 && backend == Q_Table::DENSE) {
+		m_symmetry.build_compact();
+		rows = m_symmetry.compact_size();
+	}
+
+	m_rng.seed((unsigned)time(NULL));
+	m_first_episode = 0;
+	m_q.m_backend = backend;
+	m_q.m_dense.view(backend == Q_Table::SPARSE ? Q_Store::FLOAT32 : format, nullptr, rows, (int)m_action_dim);
+
+	m_episodes = Metrics::counter((metric_prefix + "tabq_episodes").c_str());
+	m_updates = Metrics::counter((metric_prefix + "tabq_updates").c_str());
+	m_positive_rewards = Metrics::counter((metric_prefix + "tabq_positive_rewards").c_str());
+	m_negative_rewards = Metrics::counter((metric_prefix + "tabq_negative_rewards").c_str());
+	m_score = Metrics::gauge((metric_prefix + "tabq_score").c_str());
+	m_td_error = Metrics::histogram((metric_prefix + "tabq_td_error_milli").c_str());
+	m_episode_ns = Metrics::histogram((metric_prefix + "tabq_episode_ns").c_str());
+}
+
+void TabQ::seed(unsigned seed) {
+	m_rng.seed(seed);
+	m_q.m_dense.m_noise = seed | 1;
+}
+
+void TabQ::init_table() {
+	m_checkpoint.close();
+	if (m_q.m_backend == Q_Table::SPARSE) {
+		m_memory.clear();
+		m_q.m_sparse.init((int)m_action_dim, ((uint64_t)m_rng() << 32) | m_rng());
+		return;
+	}
+	Q_Store& q = m_q.m_dense;
+	m_memory.assign(Q_Store::bytes(q.m_format, q.m_rows, q.m_cols), 0);
+	q.view(q.m_format, m_memory.data(), q.m_rows, (int)m_action_dim);
+	q.fill_uniform(0.f, 1.f, m_rng);
+}
+
+int64_t TabQ::row(int64_t index, int& transform) const {
+	transform = 0;
+	if (!m_states.empty()) {
+		// Unreachable states share the last row
+		if (m_symmetry.order() > 1) {
+			index = m_symmetry.canonical(index, transform);
+		}
+		std::vector<int64_t>::const_iterator it = std::lower_bound(m_states.begin(), m_states.end(), index);
+		return it != m_states.end() && *it == index ? it - m_states.begin() : (int64_t)m_states.size();
+	}
+	if (m_symmetry.order() == 1)
+		return index;
+	return m_q.m_backend == Q_Table::SPARSE ? m_symmetry.canonical(index, transform) : m_symmetry.compact(index, transform);
+}
+
+template<typename Fn>
+void TabQ::for_each_exported(Fn fn) const {
+	if (!m_states.empty()) {
+		for (int64_t idx : m_states) {
+			fn(idx);
+		}
+		return;
+	}
+	int transform;
+	for (int64_t idx = 0; idx < m_index.size(); ++idx) {
+		if (m_index.is_exported(idx) && (m_symmetry.order() == 1 || m_symmetry.canonical(idx, transform) == idx)) {
+			fn(idx);
+		}
+	}
+}
+
+uint16_t TabQ::valid_actions(const int64_t* state, int transform) const {
+	uint16_t valid = m_world->valid_actions(state);
+	if (m_symmetry.order() == 1)
+		return valid;
+	uint16_t turned = 0;
+	for (int action = 0; action < m_action_dim; ++action) {
+		if ((valid >> action) & 1) {
+			turned |= (uint16_t)(1 << m_symmetry.action(transform, action));
+		}
+	}
+	return turned;
+}
+
+int TabQ::greedy(const std::vector<int64_t>& state) const {
+	float values[Q_Store::LANES];
+	int transform;
+	m_q.load_row(row(m_index.index(state), transform), values);
+	return m_symmetry.inverse_action(transform, arg_max(values, (int)m_action_dim, valid_actions(state.data(), transform)));
+}
+
+bool TabQ::open_checkpoint(const std::string& path, bool resume) {
+	Q_Store& q = m_q.m_dense;
+	q.m_data = nullptr;
+	m_memory.clear();
+	m_checkpoint_path = path;
+	uint64_t level_hash = m_world->m_level.hash();
+
+	if (m_q.m_backend == Q_Table::SPARSE) {
+		if (resume)
+			return load_sparse(path);
+		m_q.m_sparse.init((int)m_action_dim, ((uint64_t)m_rng() << 32) | m_rng());
+		m_first_episode = 0;
+		return checkpoint(0);
+	}
+
+	size_t size = CHECKPOINT_DATA + Q_Store::bytes(q.m_format, q.m_rows, q.m_cols);
+	if (!m_checkpoint.open_writable(path.c_str(), size)) {
+		fprintf(stderr, "Failed to map %s\n", path.c_str());
+		return false;
+	}
+
+	Q_Checkpoint_Header* header = (Q_Checkpoint_Header*)m_checkpoint.writable_data();
+	q.view(q.m_format, m_checkpoint.writable_data() + CHECKPOINT_DATA, q.m_rows, (int)m_action_dim);
+
+	if (resume) {
+		if (memcmp(header->magic, "TABQ", 4) != 0 || header->version != 1 || header->rows != (uint64_t)q.m_rows ||
+			header->cols != (uint32_t)m_action_dim || header->format != (uint32_t)q.m_format || header->level_hash != level_hash ||
+			header->backend != Q_Table::DENSE || (header->symmetry | 1) != m_symmetry.m_mask) {
+			fprintf(stderr, "%s is not a %s checkpoint of this level and table\n", path.c_str(), Q_Store::name(q.m_format));
+			m_checkpoint.close();
+			q.m_data = nullptr;
+			return false;
+		}
+		restore(*header);
+		return true;
+	}
+
+	// Fresh table, valid once the first checkpoint lands
+	memset(header, 0, sizeof(Q_Checkpoint_Header));
+	q.fill_uniform(0.f, 1.f, m_rng);
+	memcpy(header->magic, "TABQ", 4);
+	header->version = 1;
+	header->rows = q.m_rows;
+	header->cols = (uint32_t)m_action_dim;
+	header->format = (uint32_t)q.m_format;
+	header->level_hash = level_hash;
+	header->backend = Q_Table::DENSE;
+	header->symmetry = m_symmetry.m_mask;
+	m_first_episode = 0;
+	return checkpoint(0);
+}
+
+bool TabQ::load_sparse(const std::string& path) {
+	Mapped_File file;
+	if (!file.open(path.c_str())) {
+		fprintf(stderr, "Failed to map %s\n", path.c_str());
+		return false;
+	}
+
+	const Q_Checkpoint_Header* header = (const Q_Checkpoint_Header*)file.data;
+	size_t entry = sizeof(int64_t) + m_action_dim * sizeof(float);
+	if (file.size < CHECKPOINT_DATA || memcmp(header->magic, "TABQ", 4) != 0 || header->version != 1 ||
+		header->rows != (uint64_t)m_index.size() || header->cols != (uint32_t)m_action_dim ||
+		header->backend != Q_Table::SPARSE || header->level_hash != m_world->m_level.hash() || (header->symmetry | 1) != m_symmetry.m_mask ||
+		(file.size - CHECKPOINT_DATA) / entry < header->sparse_rows) {
+		fprintf(stderr, "%s is not a sparse checkpoint of this level and table\n", path.c_str());
+		return false;
+	}
+
+	m_q.m_sparse.init((int)m_action_dim, header->sparse_seed);
+	const uint8_t* in = file.data + CHECKPOINT_DATA;
+	for (uint64_t i = 0; i < header->sparse_rows; ++i, in += entry) {
+		int64_t row;
+		memcpy(&row, in, sizeof(row));
+		memcpy(m_q.m_sparse.row(row), in + sizeof(row), m_action_dim * sizeof(float));
+	}
+	restore(*header);
+	return true;
+}
+
+void TabQ::restore(const Q_Checkpoint_Header& header) {
+	std::istringstream trainer(std::string(header.rng[0], strnlen(header.rng[0], sizeof(header.rng[0]))));
+	std::istringstream world(std::string(header.rng[1], strnlen(header.rng[1], sizeof(header.rng[1]))));
+	trainer >> m_rng;
+	world >> m_world->rng();
+	m_q.m_dense.m_noise = header.rounding == 0 ? m_q.m_dense.m_noise : header.rounding;
+	m_first_episode = header.episode;
+}
+
+bool TabQ::checkpoint(uint64_t episode) {
+	TRACE_ZONE_ALWAYS("checkpoint");
+	Q_Checkpoint_Header* header;
+	std::vector<char> bytes;
+	if (m_q.m_backend == Q_Table::SPARSE) {
+		// The whole table, rows in insertion order
+		const Sparse_Q_Table& table = m_q.m_sparse;
+		size_t entry = sizeof(int64_t) + m_action_dim * sizeof(float);
+		bytes.assign(CHECKPOINT_DATA + table.size() * entry, 0);
+		char* out = bytes.data() + CHECKPOINT_DATA;
+		for (int64_t i = 0; i < table.size(); ++i, out += entry) {
+			memcpy(out, &table.m_row_keys[i], sizeof(int64_t));
+			memcpy(out + sizeof(int64_t), &table.m_arena[i * Q_Store::LANES], m_action_dim * sizeof(float));
+		}
+
+		header = (Q_Checkpoint_Header*)bytes.data();
+		memcpy(header->magic, "TABQ", 4);
+		header->version = 1;
+		header->rows = m_index.size();
+		header->cols = (uint32_t)m_action_dim;
+		header->format = Q_Store::FLOAT32;
+		header->level_hash = m_world->m_level.hash();
+		header->backend = Q_Table::SPARSE;
+		header->sparse_rows = table.size();
+		header->sparse_seed = table.m_seed;
+		header->symmetry = m_symmetry.m_mask;
+	}
+	else {
+		// Values first, a torn write then only leaves the header one checkpoint behind
+		if (!m_checkpoint.sync()) {
+			fprintf(stderr, "Failed to write the Q-table checkpoint\n");
+			return false;
+		}
+		header = (Q_Checkpoint_Header*)m_checkpoint.writable_data();
+	}
+
+	std::ostringstream trainer, world;
+	trainer << m_rng;
+	world << m_world->rng();
+	memset(header->rng, 0, sizeof(header->rng));
+	strncpy(header->rng[0], trainer.str().c_str(), sizeof(header->rng[0]) - 1);
+	strncpy(header->rng[1], world.str().c_str(), sizeof(header->rng[1]) - 1);
+	header->rounding = m_q.m_dense.m_noise;
+	header->episode = episode;
+
+	if (m_q.m_backend == Q_Table::SPARSE) {
+		m_writer.write(m_checkpoint_path, std::move(bytes));
+		return true;
+	}
+	return m_checkpoint.sync();
 }
 
-void TabQ::train() {
-	for (int epi_idx = 0; epi_idx < MAX_EPISODE; epi_idx++) {
-		int64_t action;
-		m_world->reset();
-		std::vector<int64_t> state = m_world->extract_state();
-		std::vector<int64_t> new_state = m_world->extract_state();
-		int reward = m_world->m_points;
-		int new_reward = m_world->m_points;
-		for (int t = 0; t < MAX_TIME; t++) {
-			double r = ((double)rand() / (RAND_MAX));
-			state = new_state;
-			reward = new_reward;
-			auto Q_acc = Q.accessor<float, 6>();
-			if (r < 0.05) {
-				// choose action randomly random
-				action = rand() % m_action_dim;
-			}
-			else {
-				auto score = Q_acc[state.at(0)][state.at(1)][state.at(2)][state.at(3)][state.at(4)];
-				action = arg_max(score);
-			}
-			m_world->update(action);
-
-			new_state = m_world->extract_state();
-			new_reward = m_world->m_points;
-			int reward_diff = new_reward - reward;
-
-			auto score = Q_acc[new_state.at(0)][new_state.at(1)][new_state.at(2)][new_state.at(3)][state.at(4)];
-			int max_action = arg_max(score);
-			float best_Q = score[max_action];
-			Q_acc[state.at(0)][state.at(1)][state.at(2)][state.at(3)][state.at(4)][action] += ALPHA * (reward_diff + GAMMA * best_Q - Q_acc[state.at(0)][state.at(1)][state.at(2)][state.at(3)][state.at(4)][action]);
+void TabQ::episode() {
+	int64_t action;
+	m_world->reset();
+	std::vector<int64_t> state = m_world->extract_state();
+	std::vector<int64_t> new_state = m_world->extract_state();
+	int reward = m_world->m_points;
+	int new_reward = m_world->m_points;
+	int positive_rewards = 0;
+	int negative_rewards = 0;
+	float values[Q_Store::LANES];
+	int transform;
+	for (int t = 0; t < MAX_TIME; t++) {
+		TRACE_ZONE("tabq_step");
+		double r = (double)m_rng() / m_rng.max();
+		state = new_state;
+		reward = new_reward;
+		if (r < 0.05) {
+			// choose action randomly among the valid ones
+			action = Grid_World::pick_action(m_world->valid_actions(state.data()), m_rng());
+		}
+		else {
+			TRACE_ZONE("select_action");
+			action = greedy(state);
 		}
+		m_world->update(action);
+
+		new_state = m_world->extract_state();
+		new_reward = m_world->m_points;
+		int reward_diff = new_reward - reward;
+
+		TRACE_ZONE("q_update");
+		m_q.load_row(row(m_index.index(new_state.at(0), new_state.at(1), new_state.at(2), new_state.at(3), state.at(4)), transform), values);
+		int max_action = arg_max(values, (int)m_action_dim, valid_actions(new_state.data(), transform));
+		float best_Q = values[max_action];
+		int64_t idx = row(m_index.index(state), transform);
+		int col = m_symmetry.action(transform, (int)action);
+		float value = m_q.load(idx, col);
+		float td_error = reward_diff + GAMMA * best_Q - value;
+		m_q.store(idx, col, value + ALPHA * td_error);
+
+		positive_rewards += reward_diff > 0;
+		negative_rewards += reward_diff < 0;
+		Metrics::record(m_td_error, (uint64_t)(std::fabs(td_error) * 1000.f));
+	}
+
+	Metrics::add(m_updates, MAX_TIME);
+	Metrics::add(m_positive_rewards, positive_rewards);
+	Metrics::add(m_negative_rewards, negative_rewards);
+}
+
+bool TabQ::train(bool resume) {
+	const char* enemy_names[4] = { "bat", "skeleton", "knight", "pathfinder" };
+	std::error_code error;
+	std::filesystem::create_directories(METRICS_PATH, error);
+	std::string checkpoint_path = METRICS_PATH + enemy_names[m_world->m_enemy_type] + "-" + m_world->m_level_name + "-q.bin";
+	if (!open_checkpoint(checkpoint_path, resume)) {
+		m_world->destroy();
+		return false;
+	}
+
+	Metrics::start(METRICS_PATH);
+	for (int epi_idx = (int)m_first_episode; epi_idx < MAX_EPISODE; epi_idx++) {
+		auto start = std::chrono::steady_clock::now();
+		episode();
+		Metrics::record(m_episode_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		Metrics::add(m_episodes);
+		Metrics::set(m_score, m_world->m_points);
 		// std::cout << ">> [ EPISODE ] " << epi_idx << std::endl;
 		// std::cout << ">> [ SCORE =  " << m_world->m_points << std::endl;
+		if ((epi_idx + 1) % CHECKPOINT_EVERY == 0) {
+			checkpoint(epi_idx + 1);
+		}
 	}
+	checkpoint(MAX_EPISODE);
 
 	// save policy 
 	std::string filename_policy;
@@ -77,28 +373,46 @@ void TabQ::train() {
 	else if (m_world->m_enemy_type  == 2) {
 		filename_policy = std::string("knight-") + m_world->m_level_name + std::string("-tabq_policy.txt");
 	}
+	else if (m_world->m_enemy_type  == 3) {
+		filename_policy = std::string("pathfinder-") + m_world->m_level_name + std::string("-tabq_policy.txt");
+	}
 
-	std::ofstream file_policy;
-	file_policy.open(policies_path(filename_policy), std::ios_base::trunc);
-	for (int hero_row = 0; hero_row < m_world->m_rows; ++hero_row) {
-		for (int hero_col = 0; hero_col < m_world->m_cols; ++hero_col) {
-			for (int enemy_row = 0; enemy_row < m_world->m_rows; ++enemy_row) {
-				for (int enemy_col = 0; enemy_col < m_world->m_cols; ++enemy_col) {
-					for (int enemy_act = 0; enemy_act < m_action_dim; ++enemy_act) {	
-						auto q_access = Q.accessor<float, 6>();				
-						auto q_score = q_access[hero_row][hero_col][enemy_row][enemy_col][enemy_act];
-						int action = arg_max(q_score);
-						file_policy << std::to_string(hero_row) << "," 
-								    << std::to_string(hero_col) << "," 
-								    << std::to_string(enemy_row) << "," 
-								    << std::to_string(enemy_col) << "," 
-								    << std::to_string(enemy_act) << "=" 
-								    << std::to_string(action) << std::endl;
-					}
-				}
-			}
+	TRACE_ZONE_ALWAYS("policy_export");
+	bool written = true;
+	if (m_q.m_backend == Q_Table::SPARSE) {
+		// Visited states only, a policy over every state would be as large as a dense table
+		std::vector<std::pair<int64_t, uint8_t>> actions;
+		actions.reserve(m_q.m_sparse.size());
+		m_q.for_each([this, &actions](int64_t idx, const float* values) {
+			int64_t state[5];
+			m_index.state(idx, state);
+			actions.emplace_back(idx, (uint8_t)arg_max(values, (int)m_action_dim, m_world->valid_actions(state)));
+		});
+		std::sort(actions.begin(), actions.end());
+		Policy::save_txt(policies_path(filename_policy), m_index, actions, m_symmetry.m_mask);
+		written = m_writer.flush();
+		if (!written) {
+			fprintf(stderr, "Failed to write the Q-table checkpoint\n");
 		}
 	}
-	file_policy.close();
+	else {
+		// Canonical states only under a symmetry, the writer skips the others anyway
+		Policy policy;
+		policy.init(&m_index);
+		policy.set_symmetry(m_symmetry.m_mask);
+		float values[Q_Store::LANES];
+		for_each_exported([this, &policy, &values](int64_t idx) {
+			int transform;
+			int64_t state[5];
+			m_index.state(idx, state);
+			m_q.load_row(row(idx, transform), values);
+			policy.set(idx, arg_max(values, (int)m_action_dim, valid_actions(state, transform)));
+		});
+		policy.save_txt(policies_path(filename_policy));
+	}
+	Metrics::stop();
+	m_q.m_dense.m_data = nullptr;
+	m_checkpoint.close();
 	m_world->destroy();
+	return written;
 }
\ No newline at end of file
@@ -2,29 +2,127 @@
 
 #include "grid_world.hpp"
 #include "common.hpp"
+#include "state_index.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+#include "mapped_file.hpp"
+#include "q_table.hpp"
+#include "async_writer.hpp"
+#include "symmetry.hpp"
+#include "reachable_states.hpp"
 
 // stdlib
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <random>
 
-// torch
-#include <torch/torch.h>
+// Q-table checkpoint, the header is followed by the table at CHECKPOINT_DATA. A dense Q_Store table
+// is written in place all along, so after a crash its values may be a little ahead of the header.
+// A sparse table is written whole at every checkpoint, sparse_rows entries of the int64 row and
+// its cols floats. Under a symmetry the rows are those of the canonical states.
+struct Q_Checkpoint_Header
+{
+	char magic[4];			// "TABQ"
+	uint32_t version;
+	uint64_t rows;
+	uint32_t cols;
+	uint32_t format;		// Q_Store::Format, 0 (float32) in the first checkpoints
+	uint64_t level_hash;	// Level::hash() of the level trained on
+	uint64_t episode;		// episodes done at the last checkpoint
+	char rng[2][8192];		// textual states of the trainer's and the world's generators
+	uint32_t rounding;		// Q_Store::m_noise
+	uint32_t backend;		// Q_Table::Backend, 0 (dense) in the first checkpoints
+	uint64_t sparse_rows;
+	uint64_t sparse_seed;	// Sparse_Q_Table::m_seed
+	uint32_t symmetry;		// Symmetry::m_mask, 0 (none) in the first checkpoints
+};
 
 class TabQ
 {
 public:
-	TabQ(Grid_World* grid_world);
-	void train();
+	// reachable restricts the table to the cells connected to the start cells and a dense table
+	// to one row per state reachable from the start states (Reachable_States, cached), plus one
+	// shared by all the others. The policy export then only lists those. format is the
+	// precision the values are stored in. A sparse table only holds the visited states, in float32.
+	// States are folded onto their canonical state under the level symmetries the rules keep, or
+	// that break at most symmetry_tolerance of the transitions (Symmetry::detect). A negative
+	// tolerance keeps every state. metric_prefix is put in front of the metric names, so trainers
+	// running side by side keep their own.
+	TabQ(Grid_World* grid_world, bool reachable = false, Q_Store::Format format = Q_Store::FLOAT32, Q_Table::Backend backend = Q_Table::DENSE,
+		double symmetry_tolerance = 0.0, const std::string& metric_prefix = "");
+
+	// Trains on the table mapped from ./tabq/<enemy>-<level>-q.bin, continuing from its last
+	// checkpoint when resume is set. The world is released whether it succeeds or not.
+	bool train(bool resume = false);
+
+	// Random in-memory table, enough to run episode() without train()
+	void init_table();
+
+	// Maps the table from path, or reads it for sparse tables, fresh or resumed
+	bool open_checkpoint(const std::string& path, bool resume);
+
+	// Flushes the table, then records episode and the generator states. Sparse tables are written
+	// in the background, train() waits for them at the end.
+	bool checkpoint(uint64_t episode);
+
+	// One epsilon-greedy episode of MAX_TIME updates from reset()
+	void episode();
+
+	// Valid action with the highest value in state
+	int greedy(const std::vector<int64_t>& state) const;
+
+	void seed(unsigned seed);
+
+	size_t table_bytes() const { return m_q.bytes(); }
+
+	const int MAX_TIME = 500;
 
 private:
-	torch::Tensor Q;
+	// Sparse checkpoint of path read back into the table
+	bool load_sparse(const std::string& path);
+
+	// Generators, rounding state and episode of a checkpoint
+	void restore(const Q_Checkpoint_Header& header);
+
+	// Table row of an index state and the transform into its frame, actions turn with
+	// m_symmetry.action(transform, ...)
+	int64_t row(int64_t index, int& transform) const;
+
+	// Grid_World::valid_actions of state, turned into the frame of its table row
+	uint16_t valid_actions(const int64_t* state, int transform) const;
+
+	// States the policy export lists, in ascending order
+	template<typename Fn>
+	void for_each_exported(Fn fn) const;
+
+	Q_Table m_q;
+	std::vector<uint8_t> m_memory; // dense table of init_table(), the checkpoint mapping holds it otherwise
 	const int MAX_EPISODE = 10000;
-	const int MAX_TIME = 500;
+	const int CHECKPOINT_EVERY = 100;
+	static const size_t CHECKPOINT_DATA = 20480;
+	static_assert(sizeof(Q_Checkpoint_Header) <= CHECKPOINT_DATA, "checkpoint header overlaps the table");
 	const float ALPHA = 0.1;
 	const float GAMMA = 0.99;
 
-	std::vector<int64_t> m_state_dims;
+	State_Index m_index;
+	Symmetry m_symmetry;
+	std::vector<int64_t> m_states; // reachable states in m_index, canonical ones under a symmetry, empty for the whole index
 	int64_t m_action_dim;
 	Grid_World* m_world;
+	std::mt19937 m_rng; // exploration
+	std::string METRICS_PATH = "./tabq/";
+	Mapped_File m_checkpoint;
+	std::string m_checkpoint_path;
+	Async_Writer m_writer; // sparse checkpoints
+	uint64_t m_first_episode;
+
+	// Metric ids
+	int m_episodes;
+	int m_updates;
+	int m_positive_rewards;
+	int m_negative_rewards;
+	int m_score;
+	int m_td_error; // |TD error| * 1000
+	int m_episode_ns;
 };
\ No newline at end of file
@@ -0,0 +1,167 @@
+// Header
+#include "trace.hpp"
+
+#ifdef ENABLE_TRACE
+
+// stdlib
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdio.h>
+
+namespace
+{
+	struct Event
+	{
+		const char* name;
+		uint64_t start;
+		uint64_t duration;
+	};
+
+	const uint32_t CHUNK_EVENTS = 1 << 14;
+
+	// Filled by its thread only, count is published after the event is written so end()
+	// can read the chunk list while the thread keeps appending
+	struct Chunk
+	{
+		Event events[CHUNK_EVENTS];
+		std::atomic<uint32_t> count{ 0 };
+		std::atomic<Chunk*> next{ nullptr };
+	};
+
+	std::mutex g_registry_mutex;
+	std::vector<Trace_Buffer*> g_buffers; // never freed, threads may exit before end()
+	std::atomic<bool> g_enabled(false);
+	std::atomic<unsigned> g_sample_every(1);
+	std::atomic<uint64_t> g_epoch(0);
+	std::string g_path;
+
+	uint64_t now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+}
+
+struct Trace_Buffer
+{
+	Chunk* head;
+	Chunk* tail;
+	uint32_t tid;
+	uint32_t depth;
+	uint64_t outermost; // outermost zones seen, drives sampling
+	bool sampled;
+
+	void push(const Event& event)
+	{
+		uint32_t n = tail->count.load(std::memory_order_relaxed);
+		if (n == CHUNK_EVENTS) {
+			Chunk* chunk = new Chunk();
+			tail->next.store(chunk, std::memory_order_release);
+			tail = chunk;
+			n = 0;
+		}
+		tail->events[n] = event;
+		tail->count.store(n + 1, std::memory_order_release);
+	}
+};
+
+namespace
+{
+	Trace_Buffer* thread_buffer()
+	{
+		thread_local Trace_Buffer* buffer = nullptr;
+		if (buffer == nullptr) {
+			buffer = new Trace_Buffer();
+			buffer->head = buffer->tail = new Chunk();
+			buffer->depth = 0;
+			buffer->outermost = 0;
+			buffer->sampled = false;
+
+			std::lock_guard<std::mutex> lock(g_registry_mutex);
+			buffer->tid = (uint32_t)g_buffers.size() + 1;
+			g_buffers.push_back(buffer);
+		}
+		return buffer;
+	}
+}
+
+void Trace::begin(const char* path, unsigned sample_every)
+{
+	std::lock_guard<std::mutex> lock(g_registry_mutex);
+	g_path = path;
+	g_sample_every.store(sample_every < 1 ? 1 : sample_every, std::memory_order_relaxed);
+	g_epoch.store(now_ns(), std::memory_order_relaxed);
+	g_enabled.store(true, std::memory_order_release);
+}
+
+bool Trace::end()
+{
+	if (!g_enabled.exchange(false))
+		return true;
+
+	std::lock_guard<std::mutex> lock(g_registry_mutex);
+	FILE* file = fopen(g_path.c_str(), "wb");
+	if (file == nullptr) {
+		fprintf(stderr, "Failed to open %s for writing\n", g_path.c_str());
+		return false;
+	}
+
+	// Events of earlier sessions are still in the buffers, they are skipped
+	uint64_t epoch = g_epoch.load(std::memory_order_relaxed);
+	bool first = true;
+	fprintf(file, "{\"traceEvents\":[\n");
+	for (Trace_Buffer* buffer : g_buffers) {
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}", first ? "" : ",\n", buffer->tid, buffer->tid);
+		first = false;
+
+		for (Chunk* chunk = buffer->head; chunk != nullptr; chunk = chunk->next.load(std::memory_order_acquire)) {
+			uint32_t count = chunk->count.load(std::memory_order_acquire);
+			for (uint32_t i = 0; i < count; ++i) {
+				const Event& event = chunk->events[i];
+				if (event.start < epoch)
+					continue;
+				fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+					event.name, buffer->tid, (event.start - epoch) / 1000.0, event.duration / 1000.0);
+			}
+		}
+	}
+	fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+	bool ok = !ferror(file);
+	ok = fclose(file) == 0 && ok;
+	if (!ok) {
+		fprintf(stderr, "Failed to write trace %s\n", g_path.c_str());
+	}
+	return ok;
+}
+
+Trace_Zone::Trace_Zone(const char* name, bool always) : m_buffer(nullptr), m_name(name), m_start(0), m_recorded(false)
+{
+	if (!g_enabled.load(std::memory_order_relaxed))
+		return;
+
+	m_buffer = thread_buffer();
+	if (m_buffer->depth++ == 0) {
+		m_buffer->sampled = always || m_buffer->outermost++ % g_sample_every.load(std::memory_order_relaxed) == 0;
+	}
+	m_recorded = always || m_buffer->sampled;
+	if (m_recorded) {
+		m_start = now_ns();
+	}
+}
+
+Trace_Zone::~Trace_Zone()
+{
+	if (m_buffer == nullptr)
+		return;
+
+	m_buffer->depth--;
+	if (m_recorded) {
+		uint64_t end = now_ns();
+		m_buffer->push({ m_name, m_start, end - m_start });
+	}
+}
+
+#endif
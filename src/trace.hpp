@@ -0,0 +1,59 @@
+#pragma once
+
+// Scoped trace zones written as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev).
+// Zones only exist when built with ENABLE_TRACE (cmake -DENABLE_TRACE=ON), otherwise the
+// macros expand to nothing.
+//
+//	TRACE_BEGIN("trace.json", 16);	// keep one outermost zone in 16
+//	{ TRACE_ZONE("env_step"); ... }
+//	TRACE_END();					// writes the file
+//
+// Sampling is decided by the outermost zone of a thread and inherited by the zones nested
+// in it, so sampled trees are complete. TRACE_ZONE_ALWAYS is for rare zones (checkpoints,
+// exports) that must not be sampled out.
+
+#ifdef ENABLE_TRACE
+
+// stdlib
+#include <stdint.h>
+
+class Trace
+{
+public:
+	// Starts recording, sample_every >= 1
+	static void begin(const char* path, unsigned sample_every);
+
+	// Stops recording and writes every thread's events, false if the file can't be written
+	static bool end();
+};
+
+struct Trace_Buffer;
+
+class Trace_Zone
+{
+public:
+	Trace_Zone(const char* name, bool always = false);
+	~Trace_Zone();
+
+private:
+	Trace_Buffer* m_buffer; // null while not recording
+	const char* m_name;
+	uint64_t m_start;
+	bool m_recorded;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_ZONE(name) Trace_Zone TRACE_CONCAT(trace_zone_, __LINE__)(name)
+#define TRACE_ZONE_ALWAYS(name) Trace_Zone TRACE_CONCAT(trace_zone_, __LINE__)(name, true)
+#define TRACE_BEGIN(path, sample_every) Trace::begin(path, sample_every)
+#define TRACE_END() Trace::end()
+
+#else
+
+#define TRACE_ZONE(name) ((void)0)
+#define TRACE_ZONE_ALWAYS(name) ((void)0)
+#define TRACE_BEGIN(path, sample_every) ((void)0)
+#define TRACE_END() ((void)0)
+
+#endif